@@ -8,7 +8,12 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <set>
 #include <sstream>
+#include <chrono>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 
 #include "TApplication.h"  // needed to display canvas
 #include "TSystem.h"
@@ -39,6 +44,7 @@
 #include <TTAB/DTTabUtilities.h>
 
 #include "JEventProcessor_PSvsTACCalibration.h"
+#include "PSvsTACHistoPublisher.h"
 
 using namespace jana;
 using namespace std;
@@ -63,9 +69,59 @@ uint32_t JEventProcessor_PSvsTAC_Calibration::numberOfTriggerBits = 16;
 
 // Threshold that will define when the TAC hit occurred
 unsigned JEventProcessor_PSvsTAC_Calibration::tacThreshold = 500;
+// Take the first and the last TAGH hit in the factory order as the matched and
+// the accidental hit, like the plugin did before the matching by time. Only
+// meant for comparisons with histograms made by the older versions.
+unsigned JEventProcessor_PSvsTAC_Calibration::taghMatchFirstLast = 0;
 
 string JEventProcessor_PSvsTAC_Calibration::tacRebuildFunctor = "";
 
+// Run the reference fill path on every this many events, 0 disables the validation
+unsigned JEventProcessor_PSvsTAC_Calibration::validationPrescale = 1000;
+// Relative tolerance for the bin contents of the validation histograms
+double JEventProcessor_PSvsTAC_Calibration::validationTolerance = 1.e-6;
+// Histograms filled by the reference fill path and compared. The 5000x500 TAC
+// time vs energy histos are left out, two extra copies of them per process
+// would cost about 80 MB. The threshold scan histos at TAC:THRESHOLD are added
+// by createValidationHistograms().
+const vector<string> JEventProcessor_PSvsTAC_Calibration::referenceHistoKeys = {
+		"TAC_NHITS", "TAC_TIME", "TAC_RF_TIME", "TAC_TAGH_TIME",
+		"TAC_TAGH_ENERGY", "TAC_TAGH_ENERGY_MATCHED", "TAC_TAGH_TIME_MATCHED",
+		"TAC_TAGH_ENERGY_UNMATCHED", "TAC_TAGH_TIME_UNMATCHED", "PSC_TIME",
+		"PSC_RF_TIME", "PSC_TAGH_TIME", "PSC_TAGH_ENERGY", "PSC_PAIR_NPAIRS",
+		"PSC_PAIR_DT", "PSC_PAIR_TIME", "PSC_PAIR_RF_TIME",
+		"PSC_PAIR_TAGH_TIME", "PSC_PAIR_TAGH_TIME_MATCHED",
+		"PSC_PAIR_TAGH_TIME_UNMATCHED", "PSC_PAIR_TAGH_ENERGY_MATCHED",
+		"PSC_PAIR_TAGH_ENERGY_UNMATCHED", "PSC_PAIR_TAGH_ID_MATCHED",
+		"PSC_PAIR_TAGH_ID_UNMATCHED" };
+
+// Path of the socket of the local aggregator, empty disables the publishing
+string JEventProcessor_PSvsTAC_Calibration::aggregatorSocket = "";
+// Publish the histogram changes to the aggregator every this many events
+unsigned JEventProcessor_PSvsTAC_Calibration::publishInterval = 50000;
+// Write the local ROOT file also when publishing to the aggregator
+unsigned JEventProcessor_PSvsTAC_Calibration::writeLocalFile = 1;
+
+// Online mode flag, in this mode the fills are shed to keep to the time budget
+unsigned JEventProcessor_PSvsTAC_Calibration::onlineMode = 0;
+// Time budget for processing one event in the online mode in microseconds
+double JEventProcessor_PSvsTAC_Calibration::onlineTimeBudget = 100.0;
+
+// Coincidence window between the north and south PSC hits in ns
+double JEventProcessor_PSvsTAC_Calibration::psPairWindow = 5.0;
+// Fill the PS histograms from the single-arm PSC hits as well. This is the old
+// per-hit TAGH scan and costs more than the pair stage, so it is off by default.
+unsigned JEventProcessor_PSvsTAC_Calibration::psSingleArmFill = 0;
+
+// Comma-separated list of TAC thresholds for the single-pass threshold scan
+string JEventProcessor_PSvsTAC_Calibration::tacThresholdScanList = "";
+// TAC thresholds of the scan in the ascending order
+vector<unsigned> JEventProcessor_PSvsTAC_Calibration::tacScanThresholds;
+// Width of the TAC energy bins of the threshold scan counters
+unsigned JEventProcessor_PSvsTAC_Calibration::tacScanBinWidth = 25;
+// Number of TAC energy bins of the threshold scan, the last one holds everything above
+unsigned JEventProcessor_PSvsTAC_Calibration::tacScanNumberOfBins = 401;
+
 // Timing cut value between the TAGH and TAC coincidence in ns
 double JEventProcessor_PSvsTAC_Calibration::timeCutValue_TAGH = 100.0;
 // Timing cut width between the TAGH and TAC coincidence in ns
@@ -94,10 +150,44 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::init(void) {
 
 	gPARMS->SetDefaultParameter<string,unsigned>( "TAC:THRESHOLD", tacThreshold );
 	gPARMS->GetParameter( "TAC:THRESHOLD" )->GetValue( tacThreshold );
+	gPARMS->SetDefaultParameter<string,unsigned>( "TAC:TAGH_MATCH_FIRST_LAST", taghMatchFirstLast );
+	gPARMS->GetParameter( "TAC:TAGH_MATCH_FIRST_LAST" )->GetValue( taghMatchFirstLast );
 
 	gPARMS->SetDefaultParameter<string,string>( "TAC:REBUILD_FUNC", tacRebuildFunctor );
 	gPARMS->GetParameter( "TAC:REBUILD_FUNC" )->GetValue( tacRebuildFunctor );
 
+	gPARMS->SetDefaultParameter<string,string>( "TAC:AGGREGATOR_SOCKET", aggregatorSocket );
+	gPARMS->GetParameter( "TAC:AGGREGATOR_SOCKET" )->GetValue( aggregatorSocket );
+	gPARMS->SetDefaultParameter<string,unsigned>( "TAC:PUBLISH_INTERVAL", publishInterval );
+	gPARMS->GetParameter( "TAC:PUBLISH_INTERVAL" )->GetValue( publishInterval );
+	gPARMS->SetDefaultParameter<string,unsigned>( "TAC:WRITE_LOCAL_FILE", writeLocalFile );
+	gPARMS->GetParameter( "TAC:WRITE_LOCAL_FILE" )->GetValue( writeLocalFile );
+	if (aggregatorSocket.size() > 0)
+		histoPublisher = new PSvsTACHistoPublisher(aggregatorSocket);
+	if (publishInterval == 0)
+		publishInterval = 1;
+
+	gPARMS->SetDefaultParameter<string,unsigned>( "TAC:ONLINE", onlineMode );
+	gPARMS->GetParameter( "TAC:ONLINE" )->GetValue( onlineMode );
+	gPARMS->SetDefaultParameter<string,double>( "TAC:ONLINE_TIME_BUDGET", onlineTimeBudget );
+	gPARMS->GetParameter( "TAC:ONLINE_TIME_BUDGET" )->GetValue( onlineTimeBudget );
+
+	gPARMS->SetDefaultParameter<string,unsigned>( "TAC:VALIDATION_PRESCALE", validationPrescale );
+	gPARMS->GetParameter( "TAC:VALIDATION_PRESCALE" )->GetValue( validationPrescale );
+	gPARMS->SetDefaultParameter<string,double>( "TAC:VALIDATION_TOLERANCE", validationTolerance );
+	gPARMS->GetParameter( "TAC:VALIDATION_TOLERANCE" )->GetValue( validationTolerance );
+
+	gPARMS->SetDefaultParameter<string,double>( "TAC:PS_PAIR_WINDOW", psPairWindow );
+	gPARMS->GetParameter( "TAC:PS_PAIR_WINDOW" )->GetValue( psPairWindow );
+	gPARMS->SetDefaultParameter<string,unsigned>( "TAC:PS_SINGLE_ARM", psSingleArmFill );
+	gPARMS->GetParameter( "TAC:PS_SINGLE_ARM" )->GetValue( psSingleArmFill );
+
+	gPARMS->SetDefaultParameter<string,string>( "TAC:THRESHOLD_SCAN", tacThresholdScanList );
+	gPARMS->GetParameter( "TAC:THRESHOLD_SCAN" )->GetValue( tacThresholdScanList );
+	gPARMS->SetDefaultParameter<string,unsigned>( "TAC:THRESHOLD_SCAN_BIN_WIDTH", tacScanBinWidth );
+	gPARMS->GetParameter( "TAC:THRESHOLD_SCAN_BIN_WIDTH" )->GetValue( tacScanBinWidth );
+	parseThresholdScanList();
+
 	cout << "Parameters are created " << endl;
 
 	// Create TAC directory and the histograms
@@ -105,17 +195,111 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::init(void) {
 	rootDir = gDirectory->mkdir("TAC");
 	rootDir->cd();
 	createHistograms();
+	if (validationPrescale > 0)
+		createValidationHistograms();
 	mainDir->cd();
 	cout << "Done executing JEventProcessor_PSvsTAC_Calibration::init()"
 			<< endl;
 	return NOERROR;
 }
 
+// Read the list of the threshold scan thresholds and size the energy bins.
+// Values that are not plain numbers between 0 and maxScanThreshold are
+// reported and left out.
+void JEventProcessor_PSvsTAC_Calibration::parseThresholdScanList() {
+	tacScanThresholds.clear();
+	if (tacScanBinWidth == 0)
+		tacScanBinWidth = 1;
+	string thresholdList = tacThresholdScanList;
+	replace(thresholdList.begin(), thresholdList.end(), ',', ' ');
+	stringstream thresholdStream(thresholdList);
+	string thresholdToken;
+	while (thresholdStream >> thresholdToken) {
+		// Reading into an unsigned directly would turn -100 into 4294967196
+		unsigned long threshold = 0;
+		bool isNumber = isdigit(static_cast<unsigned char>(thresholdToken[0]));
+		if (isNumber) {
+			char* tokenEnd = nullptr;
+			errno = 0;
+			threshold = strtoul(thresholdToken.c_str(), &tokenEnd, 10);
+			isNumber = (*tokenEnd == '\0' && errno == 0);
+		}
+		if (!isNumber || threshold > maxScanThreshold) {
+			cerr << "TAC threshold scan value " << thresholdToken
+					<< " is not a number between 0 and " << maxScanThreshold
+					<< ", it is ignored" << endl;
+			continue;
+		}
+		if (threshold % tacScanBinWidth != 0)
+			cout << "TAC threshold scan value " << threshold
+					<< " is not a multiple of the bin width " << tacScanBinWidth
+					<< ", it will be rounded down" << endl;
+		tacScanThresholds.push_back(threshold);
+	}
+	sort(tacScanThresholds.begin(), tacScanThresholds.end());
+	tacScanThresholds.erase(
+			unique(tacScanThresholds.begin(), tacScanThresholds.end()),
+			tacScanThresholds.end());
+	// One extra bin for the energies above the last threshold
+	unsigned maxEnergy = 10000;
+	if (tacScanThresholds.size() > 0)
+		maxEnergy = max(maxEnergy, tacScanThresholds.back() + 1);
+	tacScanNumberOfBins = maxEnergy / tacScanBinWidth + 1;
+}
+
+// Decide which fills are done for this event in the online mode. The core
+// rate histograms are always filled, the 2D and diagnostic ones are sampled
+// according to the current prescales.
+unsigned JEventProcessor_PSvsTAC_Calibration::onlineFillMask() {
+	uint64_t sampleCount = onlineSampleCount++;
+	unsigned fillMask = 0;
+	if (sampleCount % onlinePrescale2D == 0)
+		fillMask |= kFill2D;
+	if (sampleCount % onlinePrescaleDiagnostic == 0)
+		fillMask |= kFillDiagnostic;
+	return fillMask;
+}
+
+// Update the average event processing time and adjust the prescales of the
+// sampled fills. When over budget the 2D fills are sampled first and the
+// diagnostic fills next; when well under budget they are restored in the
+// opposite order.
+void JEventProcessor_PSvsTAC_Calibration::updateOnlineLoad(double eventTime) {
+	lock_guard<mutex> onlineLock(onlineMutex);
+	onlineAverageTime += 0.01 * (eventTime - onlineAverageTime);
+	if (++onlineEventCount % 1000 != 0)
+		return;
+
+	unsigned prescale2D = onlinePrescale2D;
+	unsigned prescaleDiagnostic = onlinePrescaleDiagnostic;
+	if (onlineAverageTime > onlineTimeBudget) {
+		if (prescale2D < maxOnlinePrescale)
+			prescale2D *= 2;
+		else if (prescaleDiagnostic < maxOnlinePrescale)
+			prescaleDiagnostic *= 2;
+	} else if (onlineAverageTime < 0.5 * onlineTimeBudget) {
+		if (prescaleDiagnostic > 1)
+			prescaleDiagnostic /= 2;
+		else if (prescale2D > 1)
+			prescale2D /= 2;
+	}
+	if (prescale2D != onlinePrescale2D
+			|| prescaleDiagnostic != onlinePrescaleDiagnostic) {
+		cout << "TAC online mode: average event time " << onlineAverageTime
+				<< " us for budget " << onlineTimeBudget
+				<< " us, 2D fill prescale " << prescale2D
+				<< " , diagnostic fill prescale " << prescaleDiagnostic << endl;
+	}
+	onlinePrescale2D = prescale2D;
+	onlinePrescaleDiagnostic = prescaleDiagnostic;
+}
+
 jerror_t JEventProcessor_PSvsTAC_Calibration::brun(jana::JEventLoop* eventLoop,
 		int32_t runNumber) {
 	stringstream fileNameStream;
 	fileNameStream << "ps_vs_tac_calib_" << runNumber << ".root";
 	rootFileName = fileNameStream.str();
+	currentRunNumber = runNumber;
 	return NOERROR;
 }
 
@@ -150,38 +334,86 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::evnt(jana::JEventLoop* eventLoop,
 	if (!triggerIsUseful(trigWords))
 		return NOERROR;
 
+	// In the online mode time the event and shed the 2D and diagnostic fills
+	// while the plugin is behind its time budget.
+	auto eventStartTime = chrono::steady_clock::now();
+	unsigned fillMask = kFillAll;
+	if (onlineMode)
+		fillMask = onlineFillMask();
+
+	// Run the reference fill path next to the optimized one for a sample of events
+	bool validateEvent = (validationPrescale > 0)
+			&& (eventNumber % validationPrescale == 0);
+
 	// Check the trigger bits and fill histograms
 	for (unsigned trigBit = 0; trigBit < numberOfTriggerBits; trigBit++) {
 		unsigned singleBit = 1 << trigBit;
 		// This is a TAC trigger, fill TAC-trigger-related histograms
 		if (tacTriggerMask & singleBit) {
-			fillHistosTAC(eventLoop, trigBit);
+			fillHistosTAC(eventLoop, trigBit, histoMap, fillMask);
+			if (validateEvent) {
+				fillHistosTAC(eventLoop, trigBit, validationHistoMap, kFillAll);
+				fillHistosTACReference(eventLoop, trigBit);
+			}
 		}
 		// This is a PS trigger, fill PS-trigger-related histograms
 		if (psTriggerMask & singleBit) {
-			fillHistosPS(eventLoop, trigBit);
+			fillHistosPS(eventLoop, trigBit, histoMap, fillMask);
+			if (validateEvent) {
+				fillHistosPS(eventLoop, trigBit, validationHistoMap, kFillAll);
+				fillHistosPSReference(eventLoop, trigBit);
+			}
+		}
+		// Record which fills were done for this event to allow reweighting
+		if (onlineMode && triggerIsUseful(singleBit)) {
+			volatile WriteLock rootRWLock(
+					*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+			fillHisto(histoMap, "ONLINE_SAMPLING", trigBit, 0.5);
+			if (fillMask & kFill2D)
+				fillHisto(histoMap, "ONLINE_SAMPLING", trigBit, 1.5);
+			if (fillMask & kFillDiagnostic)
+				fillHisto(histoMap, "ONLINE_SAMPLING", trigBit, 2.5);
 		}
 	}
 
+	if (onlineMode) {
+		double eventTime = chrono::duration<double, micro>(
+				chrono::steady_clock::now() - eventStartTime).count();
+		updateOnlineLoad(eventTime);
+	}
+
 	// Write histograms into ROOT file once in a while
 	if (eventNumber % 200000 == 0) {
 		this->writeHistograms();
 	}
+	// Send the changes to the aggregator once in a while
+	if (histoPublisher != nullptr && eventNumber % publishInterval == 0) {
+		this->publishHistograms(false);
+	}
 
 	return NOERROR;
 }
 
 jerror_t JEventProcessor_PSvsTAC_Calibration::erun(void) {
-	this->writeHistograms();
+	if (validationPrescale > 0)
+		compareValidationHistograms();
+	// Rewrite everything at the end of the run to get rid of the space left
+	// behind by the in-place updates.
+	this->writeHistograms(false);
+	this->publishHistograms(true);
 	return NOERROR;
 }
 
 jerror_t JEventProcessor_PSvsTAC_Calibration::fini(void) {
+	delete histoPublisher;
+	histoPublisher = nullptr;
 	return NOERROR;
 }
 
 jerror_t JEventProcessor_PSvsTAC_Calibration::createHistograms() {
 	cout << "Creating TAC histos" << endl;
+	trigGeneration.assign(numberOfTriggerBits, 0);
+	writtenTrigGeneration.assign(numberOfTriggerBits, 0);
 	for (unsigned trigBit = 0; trigBit < numberOfTriggerBits; trigBit++) {
 		unsigned trigPattern = 1 << trigBit;
 		if (triggerIsUseful(trigPattern)) {
@@ -193,6 +425,16 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::createHistograms() {
 		if (triggerIsUsefulForPS(trigPattern)) {
 			createHistogramsForPS(trigBit);
 		}
+		// Create the histo with the number of events and the number of sampled
+		// 2D and diagnostic fills in the online mode
+		if (onlineMode && triggerIsUseful(trigPattern)) {
+			createHisto<TH1D>(trigBit, "ONLINE_SAMPLING",
+					"Online mode sampled events for Trigger ", "", 3, 0., 3.);
+			TAxis* samplingAxis = histoMap["ONLINE_SAMPLING"][trigBit]->GetXaxis();
+			samplingAxis->SetBinLabel(1, "all");
+			samplingAxis->SetBinLabel(2, "2D");
+			samplingAxis->SetBinLabel(3, "diagnostic");
+		}
 	}
 	return NOERROR;
 }
@@ -262,6 +504,28 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::createHistogramsForTAC(
 			"Tagger Hodoscope Det. Number [#]", "TAGH time", 320, 0., 320., 400,
 			0., 400.);
 
+	// Create the threshold scan counters and the TAGH ID histos for each threshold
+	if (tacScanThresholds.size() > 0) {
+		size_t scanSize = size_t(tacScanNumberOfBins) * numberOfTAGHCounters;
+		thresholdScanMap[trigBit].matched.assign(scanSize, 0);
+		thresholdScanMap[trigBit].accidental.assign(scanSize, 0);
+		thresholdScanMap[trigBit].changed = false;
+	}
+	for (auto threshold : tacScanThresholds) {
+		stringstream thrTitle;
+		thrTitle << " with TAC threshold " << threshold << " for Trigger ";
+		createHisto<TH1D>(trigBit,
+				"TAC_TAGH_ID_MATCHED" + thresholdScanSuffix(threshold),
+				"Matched to TAC TAGH Hits Detector ID" + thrTitle.str(),
+				"Tagger Hodoscope Det. Number [#]", numberOfTAGHCounters, 0.,
+				numberOfTAGHCounters);
+		createHisto<TH1D>(trigBit,
+				"TAC_TAGH_ID_UNMATCHED" + thresholdScanSuffix(threshold),
+				"Accidental to TAC TAGH Hits Detector ID" + thrTitle.str(),
+				"Tagger Hodoscope Det. Number [#]", numberOfTAGHCounters, 0.,
+				numberOfTAGHCounters);
+	}
+
 	// Create TAGM Hits detector ID
 	createHisto<TH1D>(trigBit, "TAC_TAGM_ID_UNMATCHED",
 			"Accidental to TAC TAGM Hits Detector ID for Trigger ",
@@ -337,11 +601,58 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::createHistogramsForPS(
 	createHisto<TH1D>(trigBit, "PSC_TAGH_TIME",
 			"TAGH Signal time relative to PS for Trigger ",
 			"FlashADC peak time (ns)", 400, 0., 400.);
+
+	// Create number of PSC north/south pairs histo
+	createHisto<TH1D>(trigBit, "PSC_PAIR_NPAIRS",
+			"Number of PSC north/south pairs for Trigger ",
+			"number of PSC pairs [#]", 10, 0., 10.);
+	// Create PSC north - south time difference histo
+	createHisto<TH1D>(trigBit, "PSC_PAIR_DT",
+			"PSC north - south time for Trigger ",
+			"PSC north - south time [ns]", 400, -20., 20.);
+	// Create PSC pair time histos
+	createHisto<TH1D>(trigBit, "PSC_PAIR_TIME", "PSC pair time",
+			"PSC pair time [ns]", 10000, -300., 300.);
+	createHisto<TH1D>(trigBit, "PSC_PAIR_RF_TIME", "PSC pair time wrt RF",
+			"PSC pair - RF time [ns]", 10000, -300., 300.);
+
+	// Create TAGH signal time relative to PSC pair histos
+	createHisto<TH1D>(trigBit, "PSC_PAIR_TAGH_TIME",
+			"TAGH Signal time relative to PSC pair for Trigger ",
+			"TAGH time (ns)", 600, -300, 300.);
+	createHisto<TH1D>(trigBit, "PSC_PAIR_TAGH_TIME_MATCHED",
+			"TAGH Signal time relative to PSC pair for matched hits for Trigger ",
+			"TAGH time (ns)", 10000, -300, 300.);
+	createHisto<TH1D>(trigBit, "PSC_PAIR_TAGH_TIME_UNMATCHED",
+			"TAGH Signal time relative to PSC pair for unmatched hits for Trigger ",
+			"TAGH time (ns)", 10000, -300, 300.);
+
+	// Create TAGH Hits energy for PSC pairs
+	createHisto<TH1D>(trigBit, "PSC_PAIR_TAGH_ENERGY_MATCHED",
+			"Matched to PSC pair TAGH Hits Energy for Trigger ",
+			"Tagger Hodoscope Energy (GeV)", 500, 3., 12.0);
+	createHisto<TH1D>(trigBit, "PSC_PAIR_TAGH_ENERGY_UNMATCHED",
+			"Accidental to PSC pair TAGH Hits Energy for Trigger ",
+			"Tagger Hodoscope Energy (GeV)", 500, 3., 12.0);
+
+	// Create TAGH Hits detector ID for PSC pairs
+	createHisto<TH1D>(trigBit, "PSC_PAIR_TAGH_ID_MATCHED",
+			"Matched to PSC pair TAGH Hits Detector ID for Trigger ",
+			"Tagger Hodoscope Det. Number [#]", 320, 0., 320.);
+	createHisto<TH1D>(trigBit, "PSC_PAIR_TAGH_ID_UNMATCHED",
+			"Accidental to PSC pair TAGH Hits Detector ID for Trigger ",
+			"Tagger Hodoscope Det. Number [#]", 320, 0., 320.);
 	return NOERROR;
 }
 
 jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosTAC(
 		jana::JEventLoop* eventLoop, uint32_t trigBit) {
+	return fillHistosTAC(eventLoop, trigBit, histoMap, kFillAll);
+}
+
+jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosTAC(
+		jana::JEventLoop* eventLoop, uint32_t trigBit, HistoMap& targetMap,
+		unsigned fillMask) {
 
 //	vector<const DTACHit*> tacHitOriginalVector;
 //	eventLoop->Get(tacHitOriginalVector);
@@ -358,15 +669,27 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosTAC(
 	{
 		volatile WriteLock rootRWLock(
 				*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
-		histoMap["TAC_NHITS"][trigBit]->Fill((double) tacHitVector.size());
+		fillHisto(targetMap, "TAC_NHITS", trigBit, (double) tacHitVector.size());
 
 	}
 	if( tacHitVector.size() < 1 ) return NOERROR;
 	for (auto& tacHit : tacHitVector) {
 
-		// Make sure that there is a valid TAC hit and the energy is above some
-		// reasonable threshold
-		if (tacHit == nullptr || tacHit->getE() < tacThreshold )
+		if (tacHit == nullptr)
+			continue;
+		// The threshold scan counts every TAC hit, the thresholds are applied
+		// only when the results are written out. The validation fills have
+		// their own counters.
+		ThresholdScanMap* scanMap = nullptr;
+		if (&targetMap == &histoMap)
+			scanMap = &thresholdScanMap;
+		else if (&targetMap == &validationHistoMap)
+			scanMap = &validationThresholdScanMap;
+		if (scanMap != nullptr && scanMap->count(trigBit) > 0)
+			recordThresholdScan(eventLoop, tacHit, (*scanMap)[trigBit]);
+
+		// Make sure that the energy is above some reasonable threshold
+		if (tacHit->getE() < tacThreshold)
 			continue;
 //		const DRFTime* rfTimeObjectBest;
 //		eventLoop->GetSingle(rfTimeObjectBest, "", true);
@@ -392,49 +715,46 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosTAC(
 //				<< rfTimeObjectPSC->dTime << " , TAGH RF time is "
 //				<< rfTimeObjectTAGH->dTime << endl;
 
-		if (rfTimeObjectTOF != nullptr) {
+		if (rfTimeObjectTOF != nullptr && (fillMask & kFillDiagnostic)) {
 			volatile WriteLock rootRWLock(
 					*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
-			histoMap["TAC_TIME"][trigBit]->Fill(tacHit->getT());
-			histoMap["TAC_RF_TIME"][trigBit]->Fill(
+			fillHisto(targetMap, "TAC_TIME", trigBit, tacHit->getT());
+			fillHisto(targetMap, "TAC_RF_TIME", trigBit,
 					tacHit->getT() - rfTimeObjectTOF->dTime);
-			histoMap["TAC_TIME_VS_E"][trigBit]->Fill(tacHit->getE(),
+		}
+		if (rfTimeObjectTOF != nullptr && (fillMask & kFill2D)) {
+			volatile WriteLock rootRWLock(
+					*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+			fillHisto(targetMap, "TAC_TIME_VS_E", trigBit, tacHit->getE(),
 					tacHit->getT());
-			histoMap["TAC_RF_TIME_VS_E"][trigBit]->Fill(tacHit->getE(),
+			fillHisto(targetMap, "TAC_RF_TIME_VS_E", trigBit, tacHit->getE(),
 					tacHit->getT() - rfTimeObjectTOF->dTime);
 		}
 
-		// Declare comparison functor for this TAC hits and the TAGH hits.
-		auto compareFunctorTAGH =
-				[&tacHit](const DTAGHHit* lhs, const DTAGHHit* rhs ) ->
-				bool {return( (lhs!=nullptr)&(rhs!=nullptr ) ? fabs(lhs->t-tacHit->getT()) < fabs(rhs->t-tacHit->getT() ) : false );};
-
 		vector<const DTAGHHit*> taghHitVector;
 		eventLoop->Get(taghHitVector);
 		for (auto& taghHit : taghHitVector) {
-			if (taghHit != nullptr) {
+			if (taghHit != nullptr && (fillMask & kFillDiagnostic)) {
 				volatile WriteLock rootRWLock(
 						*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
-				histoMap["TAC_TAGH_TIME"][trigBit]->Fill(
+				fillHisto(targetMap, "TAC_TAGH_TIME", trigBit,
 						taghHit->t - tacHit->getT());
-				histoMap["TAC_TAGH_ENERGY"][trigBit]->Fill(taghHit->E);
+				fillHisto(targetMap, "TAC_TAGH_ENERGY", trigBit, taghHit->E);
 			}
 		}
 		if (taghHitVector.size() > 0) {
-			// Find best match in TACH and make an entry by looping through the TAGH hits
-			std::nth_element(taghHitVector.begin(), taghHitVector.end(),
-					taghHitVector.end(), compareFunctorTAGH);
-			const DTAGHHit* taghBestHit = taghHitVector[0];
-			const DTAGHHit* taghWorstMatch = taghHitVector[taghHitVector.size()
-					- 1];
+			const DTAGHHit* taghBestHit = nullptr;
+			const DTAGHHit* taghWorstMatch = nullptr;
+			findTAGHMatches(tacHit->getT(), taghHitVector, taghBestHit,
+					taghWorstMatch);
 			if (taghBestHit != nullptr) {
 				volatile WriteLock rootRWLock(
 						*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
 				double photonEnergy = taghBestHit->E;
 				double photonTime = taghBestHit->t;
-				histoMap["TAC_TAGH_ENERGY_MATCHED"][trigBit]->Fill(
+				fillHisto(targetMap, "TAC_TAGH_ENERGY_MATCHED", trigBit,
 						photonEnergy);
-				histoMap["TAC_TAGH_TIME_MATCHED"][trigBit]->Fill(
+				fillHisto(targetMap, "TAC_TAGH_TIME_MATCHED", trigBit,
 						photonTime - tacHit->getT());
 			}
 			if (taghWorstMatch != nullptr) {
@@ -442,9 +762,9 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosTAC(
 						*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
 				double photonEnergy = taghWorstMatch->E;
 				double photonTime = taghWorstMatch->t;
-				histoMap["TAC_TAGH_TIME_UNMATCHED"][trigBit]->Fill(
+				fillHisto(targetMap, "TAC_TAGH_TIME_UNMATCHED", trigBit,
 						photonTime - tacHit->getT());
-				histoMap["TAC_TAGH_ENERGY_UNMATCHED"][trigBit]->Fill(
+				fillHisto(targetMap, "TAC_TAGH_ENERGY_UNMATCHED", trigBit,
 						photonEnergy);
 			}
 		}
@@ -453,8 +773,190 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosTAC(
 	return NOERROR;
 }
 
+// Find the TAGH hits used as the matched and the accidental hit for a
+// reference time: the matched hit is the closest in time, the accidental one
+// is the furthest. With taghMatchFirstLast they are the first and the last hit
+// in the factory order, which is what the original sorting code ended up with.
+void JEventProcessor_PSvsTAC_Calibration::findTAGHMatches(double refTime,
+		const vector<const DTAGHHit*>& taghHitVector,
+		const DTAGHHit*& taghBestHit, const DTAGHHit*& taghWorstMatch) {
+	taghBestHit = nullptr;
+	taghWorstMatch = nullptr;
+	if (taghMatchFirstLast) {
+		if (taghHitVector.size() > 0) {
+			taghBestHit = taghHitVector.front();
+			taghWorstMatch = taghHitVector.back();
+		}
+		return;
+	}
+	for (auto& taghHit : taghHitVector) {
+		if (taghHit == nullptr)
+			continue;
+		double deltaT = fabs(taghHit->t - refTime);
+		if (taghBestHit == nullptr || deltaT < fabs(taghBestHit->t - refTime))
+			taghBestHit = taghHit;
+		if (taghWorstMatch == nullptr
+				|| deltaT > fabs(taghWorstMatch->t - refTime))
+			taghWorstMatch = taghHit;
+	}
+}
+
+// Plain matching for the reference fill path: the matched and the accidental
+// hit are found with the standard algorithms over all valid TAGH hits, taking
+// the first one among equal time differences like findTAGHMatches does. With
+// taghMatchFirstLast the original sorting code is used.
+void JEventProcessor_PSvsTAC_Calibration::findTAGHMatchesReference(
+		double refTime, vector<const DTAGHHit*> taghHitVector,
+		const DTAGHHit*& taghBestHit, const DTAGHHit*& taghWorstMatch) {
+	taghBestHit = nullptr;
+	taghWorstMatch = nullptr;
+	if (taghHitVector.size() < 1)
+		return;
+	if (taghMatchFirstLast) {
+		// nth_element with nth == last leaves the order unchanged, so these
+		// are the first and the last TAGH hits
+		auto compareFunctorTAGH =
+				[refTime](const DTAGHHit* lhs, const DTAGHHit* rhs ) ->
+				bool {return( (lhs!=nullptr)&(rhs!=nullptr ) ? fabs(lhs->t-refTime) < fabs(rhs->t-refTime ) : false );};
+		std::nth_element(taghHitVector.begin(), taghHitVector.end(),
+				taghHitVector.end(), compareFunctorTAGH);
+		taghBestHit = taghHitVector[0];
+		taghWorstMatch = taghHitVector[taghHitVector.size() - 1];
+		return;
+	}
+	taghHitVector.erase(
+			remove(taghHitVector.begin(), taghHitVector.end(), nullptr),
+			taghHitVector.end());
+	if (taghHitVector.size() < 1)
+		return;
+	auto closerHit = [refTime](const DTAGHHit* lhs, const DTAGHHit* rhs) ->
+			bool {return fabs(lhs->t - refTime) < fabs(rhs->t - refTime);};
+	taghBestHit = *min_element(taghHitVector.begin(), taghHitVector.end(),
+			closerHit);
+	taghWorstMatch = *max_element(taghHitVector.begin(), taghHitVector.end(),
+			closerHit);
+}
+
+// Count the matched and accidental TAGH hits for this TAC hit in the bin of
+// its energy, regardless of the TAC threshold.
+void JEventProcessor_PSvsTAC_Calibration::recordThresholdScan(
+		jana::JEventLoop* eventLoop, const DTACHit* tacHit,
+		ThresholdScanCounts& scanCounts) {
+	vector<const DTAGHHit*> taghHitVector;
+	eventLoop->Get(taghHitVector);
+	const DTAGHHit* taghBestHit = nullptr;
+	const DTAGHHit* taghWorstMatch = nullptr;
+	findTAGHMatches(tacHit->getT(), taghHitVector, taghBestHit, taghWorstMatch);
+
+	double tacEnergy = tacHit->getE();
+	unsigned energyBin = 0;
+	if (tacEnergy > 0)
+		energyBin = min<unsigned>(tacEnergy / tacScanBinWidth,
+				tacScanNumberOfBins - 1);
+
+	volatile WriteLock rootRWLock(
+			*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+	if (taghBestHit != nullptr && taghBestHit->counter_id >= 0
+			&& unsigned(taghBestHit->counter_id) < numberOfTAGHCounters) {
+		scanCounts.matched[energyBin * numberOfTAGHCounters
+				+ taghBestHit->counter_id]++;
+		scanCounts.changed = true;
+	}
+	if (taghWorstMatch != nullptr && taghWorstMatch->counter_id >= 0
+			&& unsigned(taghWorstMatch->counter_id) < numberOfTAGHCounters) {
+		scanCounts.accidental[energyBin * numberOfTAGHCounters
+				+ taghWorstMatch->counter_id]++;
+		scanCounts.changed = true;
+	}
+}
+
+// Turn the threshold scan counters into matched and accidental TAGH ID
+// histograms for each scan threshold by summing the energy bins from the top
+// down to the threshold. Histograms missing from the target map are skipped.
+// The ROOT lock must be held by the caller.
+void JEventProcessor_PSvsTAC_Calibration::fillThresholdScanHistos(
+		ThresholdScanMap& scanMap, HistoMap& targetMap) {
+	for (auto& scanIter : scanMap) {
+		unsigned trigBit = scanIter.first;
+		ThresholdScanCounts& scanCounts = scanIter.second;
+		if (!scanCounts.changed)
+			continue;
+		scanCounts.changed = false;
+
+		vector<uint64_t> matchedSum(numberOfTAGHCounters, 0);
+		vector<uint64_t> accidentalSum(numberOfTAGHCounters, 0);
+		auto& matchedCounts = scanCounts.matched;
+		auto& accidentalCounts = scanCounts.accidental;
+		// Thresholds are sorted in the ascending order, go through them from
+		// the last one while accumulating the energy bins downwards.
+		auto thrIter = tacScanThresholds.rbegin();
+		for (int energyBin = tacScanNumberOfBins - 1;
+				energyBin >= 0 && thrIter != tacScanThresholds.rend();
+				energyBin--) {
+			for (unsigned counter = 0; counter < numberOfTAGHCounters;
+					counter++) {
+				matchedSum[counter] += matchedCounts[energyBin
+						* numberOfTAGHCounters + counter];
+				accidentalSum[counter] += accidentalCounts[energyBin
+						* numberOfTAGHCounters + counter];
+			}
+			for (; thrIter != tacScanThresholds.rend()
+					&& *thrIter / tacScanBinWidth == unsigned(energyBin);
+					thrIter++) {
+				TH1* matchedHist = findHisto(targetMap,
+						"TAC_TAGH_ID_MATCHED" + thresholdScanSuffix(*thrIter),
+						trigBit);
+				TH1* accidentalHist = findHisto(targetMap,
+						"TAC_TAGH_ID_UNMATCHED" + thresholdScanSuffix(*thrIter),
+						trigBit);
+				if (matchedHist == nullptr || accidentalHist == nullptr)
+					continue;
+				// The changed bins of the main map histos are passed to the
+				// publisher, they do not go through fillHisto()
+				bool recordChanges = (&targetMap == &histoMap)
+						&& (histoPublisher != nullptr);
+				double matchedTotal = 0;
+				double accidentalTotal = 0;
+				for (unsigned counter = 0; counter < numberOfTAGHCounters;
+						counter++) {
+					if (recordChanges) {
+						histoPublisher->recordContentChange(matchedHist,
+								counter + 1, matchedSum[counter]
+										- matchedHist->GetBinContent(counter + 1));
+						histoPublisher->recordContentChange(accidentalHist,
+								counter + 1, accidentalSum[counter]
+										- accidentalHist->GetBinContent(
+												counter + 1));
+					}
+					matchedHist->SetBinContent(counter + 1, matchedSum[counter]);
+					accidentalHist->SetBinContent(counter + 1,
+							accidentalSum[counter]);
+					matchedTotal += matchedSum[counter];
+					accidentalTotal += accidentalSum[counter];
+				}
+				matchedHist->SetEntries(matchedTotal);
+				accidentalHist->SetEntries(accidentalTotal);
+				if (&targetMap == &histoMap) {
+					markDirty(matchedHist, trigBit);
+					markDirty(accidentalHist, trigBit);
+				}
+			}
+		}
+	}
+}
+
 jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosPS(
 		jana::JEventLoop* eventLoop, uint32_t trigBit) {
+	return fillHistosPS(eventLoop, trigBit, histoMap, kFillAll);
+}
+
+jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosPS(
+		jana::JEventLoop* eventLoop, uint32_t trigBit, HistoMap& targetMap,
+		unsigned fillMask) {
+	fillHistosPSPairs(eventLoop, trigBit, targetMap, fillMask);
+	if (!psSingleArmFill)
+		return NOERROR;
+
 	vector<const DPSCHit*> pscHitVector;
 	eventLoop->Get(pscHitVector);
 
@@ -465,10 +967,8 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosPS(
 		if( pscHit->has_TDC && pscHit->arm == DPSGeometry::kNorth ) {
 			volatile WriteLock rootRWLock(
 					*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
-			histoMap["PSC_TIME"][trigBit]->Fill( pscHit->t );
+			fillHisto(targetMap, "PSC_TIME", trigBit, pscHit->t );
 		}
-		const DRFTime* rfTimeObjectBest;
-//		eventLoop->GetSingle(rfTimeObjectBest, "", true);
 //
 //		const DRFTime* rfTimeObjectTOF;
 //		eventLoop->GetSingle(rfTimeObjectTOF, "TOF", true);
@@ -477,10 +977,277 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosPS(
 //		const DRFTime* rfTimeObjectTAGH;
 //		eventLoop->GetSingle(rfTimeObjectTAGH, "TAGH", true);
 
+		if (rfTimeObjectPSC != nullptr && pscHit->has_TDC && pscHit->arm == DPSGeometry::kNorth
+				&& (fillMask & kFillDiagnostic)) {
+			volatile WriteLock rootRWLock(
+					*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+			fillHisto(targetMap, "PSC_RF_TIME", trigBit,
+					pscHit->t - rfTimeObjectPSC->dTime);
+		}
+
+		if (!(fillMask & kFillDiagnostic))
+			continue;
+		vector<const DTAGHHit*> taghHitVector;
+		eventLoop->Get(taghHitVector);
+		for (auto& taghHit : taghHitVector) {
+			if (taghHit != nullptr) {
+				volatile WriteLock rootRWLock(
+						*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+				fillHisto(targetMap, "PSC_TAGH_TIME", trigBit,
+						taghHit->t - pscHit->t);
+				fillHisto(targetMap, "PSC_TAGH_ENERGY", trigBit, taghHit->E);
+			}
+		}
+
+	}
+	return NOERROR;
+}
+
+// Find coincidences between the north and south PSC arms and match them to
+// the TAGH hits using the time of the pair.
+jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosPSPairs(
+		jana::JEventLoop* eventLoop, uint32_t trigBit, HistoMap& targetMap,
+		unsigned fillMask) {
+	vector<const DPSCHit*> pscHitVector;
+	eventLoop->Get(pscHitVector);
+
+	// Split the PSC hits with TDC times by arm and sort them in time
+	vector<const DPSCHit*> northHitVector;
+	vector<const DPSCHit*> southHitVector;
+	for (auto& pscHit : pscHitVector) {
+		if (pscHit == nullptr || !pscHit->has_TDC)
+			continue;
+		if (pscHit->arm == DPSGeometry::kNorth)
+			northHitVector.push_back(pscHit);
+		else
+			southHitVector.push_back(pscHit);
+	}
+	auto earlierHit = [](const DPSCHit* lhs, const DPSCHit* rhs) ->
+			bool {return lhs->t < rhs->t;};
+	sort(northHitVector.begin(), northHitVector.end(), earlierHit);
+	sort(southHitVector.begin(), southHitVector.end(), earlierHit);
+
+	// Collect the north/south candidates inside the coincidence window in one
+	// sweep over the sorted arms. The pairs are then made one-to-one taking the
+	// closest candidates first, so a hit that loses its closest partner to a
+	// closer pair can still pair with the next one.
+	vector<PSCPairCandidate> candidateVector;
+	auto southBegin = southHitVector.begin();
+	for (unsigned iNorth = 0; iNorth < northHitVector.size(); iNorth++) {
+		const DPSCHit* northHit = northHitVector[iNorth];
+		while (southBegin != southHitVector.end()
+				&& northHit->t - (*southBegin)->t >= psPairWindow)
+			southBegin++;
+		for (auto southIter = southBegin; southIter != southHitVector.end();
+				southIter++) {
+			double deltaT = northHit->t - (*southIter)->t;
+			if (deltaT <= -psPairWindow)
+				break;
+			candidateVector.push_back(
+					PSCPairCandidate { fabs(deltaT), northHit, *southIter,
+							iNorth, unsigned(southIter
+									- southHitVector.begin()) });
+		}
+	}
+	sort(candidateVector.begin(), candidateVector.end());
+
+	vector<bool> northPaired(northHitVector.size(), false);
+	vector<bool> southPaired(southHitVector.size(), false);
+	vector<pair<const DPSCHit*, const DPSCHit*> > pairVector;
+	for (auto& candidate : candidateVector) {
+		if (northPaired[candidate.northIndex]
+				|| southPaired[candidate.southIndex])
+			continue;
+		northPaired[candidate.northIndex] = true;
+		southPaired[candidate.southIndex] = true;
+		pairVector.push_back(make_pair(candidate.northHit, candidate.southHit));
+	}
+
+	{
+		volatile WriteLock rootRWLock(
+				*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+		fillHisto(targetMap, "PSC_PAIR_NPAIRS", trigBit, (double) pairVector.size());
+	}
+	if (pairVector.size() < 1)
+		return NOERROR;
+
+	const DRFTime* rfTimeObjectPSC;
+	eventLoop->GetSingle(rfTimeObjectPSC, "PSC", true);
+
+	vector<const DTAGHHit*> taghHitVector;
+	eventLoop->Get(taghHitVector);
+
+	// Same matching as for the TAC hits, using the time of the pair. It is
+	// done before taking the lock, which is then held only for the fills.
+	vector<double> pairTimeVector;
+	vector<const DTAGHHit*> taghBestHitVector;
+	vector<const DTAGHHit*> taghWorstMatchVector;
+	for (auto& pscPair : pairVector) {
+		double pairTime = 0.5 * (pscPair.first->t + pscPair.second->t);
+		const DTAGHHit* taghBestHit = nullptr;
+		const DTAGHHit* taghWorstMatch = nullptr;
+		findTAGHMatches(pairTime, taghHitVector, taghBestHit, taghWorstMatch);
+		pairTimeVector.push_back(pairTime);
+		taghBestHitVector.push_back(taghBestHit);
+		taghWorstMatchVector.push_back(taghWorstMatch);
+	}
+
+	volatile WriteLock rootRWLock(
+			*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+	for (unsigned iPair = 0; iPair < pairVector.size(); iPair++) {
+		auto& pscPair = pairVector[iPair];
+		double pairTime = pairTimeVector[iPair];
+		fillHisto(targetMap, "PSC_PAIR_TIME", trigBit, pairTime);
+		if (fillMask & kFillDiagnostic) {
+			fillHisto(targetMap, "PSC_PAIR_DT", trigBit,
+					pscPair.first->t - pscPair.second->t);
+			if (rfTimeObjectPSC != nullptr)
+				fillHisto(targetMap, "PSC_PAIR_RF_TIME", trigBit,
+						pairTime - rfTimeObjectPSC->dTime);
+			for (auto& taghHit : taghHitVector) {
+				if (taghHit != nullptr)
+					fillHisto(targetMap, "PSC_PAIR_TAGH_TIME", trigBit,
+							taghHit->t - pairTime);
+			}
+		}
+
+		const DTAGHHit* taghBestHit = taghBestHitVector[iPair];
+		const DTAGHHit* taghWorstMatch = taghWorstMatchVector[iPair];
+		if (taghBestHit != nullptr) {
+			fillHisto(targetMap, "PSC_PAIR_TAGH_ENERGY_MATCHED", trigBit, taghBestHit->E);
+			fillHisto(targetMap, "PSC_PAIR_TAGH_ID_MATCHED", trigBit, taghBestHit->counter_id);
+			fillHisto(targetMap, "PSC_PAIR_TAGH_TIME_MATCHED", trigBit,
+					taghBestHit->t - pairTime);
+		}
+		if (taghWorstMatch != nullptr) {
+			fillHisto(targetMap, "PSC_PAIR_TAGH_ENERGY_UNMATCHED", trigBit,
+					taghWorstMatch->E);
+			fillHisto(targetMap, "PSC_PAIR_TAGH_ID_UNMATCHED", trigBit,
+					taghWorstMatch->counter_id);
+			fillHisto(targetMap, "PSC_PAIR_TAGH_TIME_UNMATCHED", trigBit,
+					taghWorstMatch->t - pairTime);
+		}
+	}
+	return NOERROR;
+}
+
+// Reference implementation of the TAC and PS fills written in the plainest
+// way, without the sweeps and counters of the optimized code. It fills
+// referenceHistoMap on the validation events so that the results of the
+// optimized fill path can be checked against it. Histograms missing from
+// referenceHistoMap are skipped.
+jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosTACReference(
+		jana::JEventLoop* eventLoop, uint32_t trigBit) {
+	vector<const DTACHit*> tacHitVector;
+	eventLoop->Get( tacHitVector, tacRebuildFunctor.c_str() );
+	{
+		volatile WriteLock rootRWLock(
+				*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+		fillHisto(referenceHistoMap, "TAC_NHITS", trigBit,
+				(double) tacHitVector.size());
+	}
+	if( tacHitVector.size() < 1 ) return NOERROR;
+	for (auto& tacHit : tacHitVector) {
+
+		// Make sure that there is a valid TAC hit and the energy is above some
+		// reasonable threshold
+		if (tacHit == nullptr || tacHit->getE() < tacThreshold )
+			continue;
+
+		const DRFTime* rfTimeObjectTOF;
+		eventLoop->GetSingle(rfTimeObjectTOF, "TOF", true);
+		if (rfTimeObjectTOF != nullptr) {
+			volatile WriteLock rootRWLock(
+					*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+			fillHisto(referenceHistoMap, "TAC_TIME", trigBit, tacHit->getT());
+			fillHisto(referenceHistoMap, "TAC_RF_TIME", trigBit,
+					tacHit->getT() - rfTimeObjectTOF->dTime);
+			fillHisto(referenceHistoMap, "TAC_TIME_VS_E", trigBit,
+					tacHit->getE(), tacHit->getT());
+			fillHisto(referenceHistoMap, "TAC_RF_TIME_VS_E", trigBit,
+					tacHit->getE(), tacHit->getT() - rfTimeObjectTOF->dTime);
+		}
+
+		vector<const DTAGHHit*> taghHitVector;
+		eventLoop->Get(taghHitVector);
+		for (auto& taghHit : taghHitVector) {
+			if (taghHit != nullptr) {
+				volatile WriteLock rootRWLock(
+						*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+				fillHisto(referenceHistoMap, "TAC_TAGH_TIME", trigBit,
+						taghHit->t - tacHit->getT());
+				fillHisto(referenceHistoMap, "TAC_TAGH_ENERGY", trigBit,
+						taghHit->E);
+			}
+		}
+		if (taghHitVector.size() > 0) {
+			const DTAGHHit* taghBestHit = nullptr;
+			const DTAGHHit* taghWorstMatch = nullptr;
+			findTAGHMatchesReference(tacHit->getT(), taghHitVector,
+					taghBestHit, taghWorstMatch);
+			if (taghBestHit != nullptr) {
+				volatile WriteLock rootRWLock(
+						*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+				fillHisto(referenceHistoMap, "TAC_TAGH_ENERGY_MATCHED", trigBit,
+						taghBestHit->E);
+				fillHisto(referenceHistoMap, "TAC_TAGH_TIME_MATCHED", trigBit,
+						taghBestHit->t - tacHit->getT());
+			}
+			if (taghWorstMatch != nullptr) {
+				volatile WriteLock rootRWLock(
+						*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+				fillHisto(referenceHistoMap, "TAC_TAGH_TIME_UNMATCHED", trigBit,
+						taghWorstMatch->t - tacHit->getT());
+				fillHisto(referenceHistoMap, "TAC_TAGH_ENERGY_UNMATCHED",
+						trigBit, taghWorstMatch->E);
+			}
+
+			// Direct fill of the threshold scan histos at TAC:THRESHOLD, the
+			// scan only counts the TAGH counters inside the histos
+			volatile WriteLock rootRWLock(
+					*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+			string thrSuffix = thresholdScanSuffix(tacThreshold);
+			if (taghBestHit != nullptr && taghBestHit->counter_id >= 0
+					&& unsigned(taghBestHit->counter_id) < numberOfTAGHCounters)
+				fillHisto(referenceHistoMap, "TAC_TAGH_ID_MATCHED" + thrSuffix,
+						trigBit, taghBestHit->counter_id);
+			if (taghWorstMatch != nullptr && taghWorstMatch->counter_id >= 0
+					&& unsigned(taghWorstMatch->counter_id)
+							< numberOfTAGHCounters)
+				fillHisto(referenceHistoMap,
+						"TAC_TAGH_ID_UNMATCHED" + thrSuffix, trigBit,
+						taghWorstMatch->counter_id);
+		}
+	}
+
+	return NOERROR;
+}
+
+jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosPSReference(
+		jana::JEventLoop* eventLoop, uint32_t trigBit) {
+	fillHistosPSPairsReference(eventLoop, trigBit);
+	if (!psSingleArmFill)
+		return NOERROR;
+
+	vector<const DPSCHit*> pscHitVector;
+	eventLoop->Get(pscHitVector);
+
+	for (auto& pscHit : pscHitVector) {
+
+		if (pscHit == nullptr)
+			continue;
+		if( pscHit->has_TDC && pscHit->arm == DPSGeometry::kNorth ) {
+			volatile WriteLock rootRWLock(
+					*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+			fillHisto(referenceHistoMap, "PSC_TIME", trigBit, pscHit->t );
+		}
+
+		const DRFTime* rfTimeObjectPSC;
+		eventLoop->GetSingle(rfTimeObjectPSC, "PSC", true);
 		if (rfTimeObjectPSC != nullptr && pscHit->has_TDC && pscHit->arm == DPSGeometry::kNorth ) {
 			volatile WriteLock rootRWLock(
 					*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
-			histoMap["PSC_RF_TIME"][trigBit]->Fill(
+			fillHisto(referenceHistoMap, "PSC_RF_TIME", trigBit,
 					pscHit->t - rfTimeObjectPSC->dTime);
 		}
 
@@ -490,31 +1257,276 @@ jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosPS(
 			if (taghHit != nullptr) {
 				volatile WriteLock rootRWLock(
 						*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
-				histoMap["PSC_TAGH_TIME"][trigBit]->Fill(
+				fillHisto(referenceHistoMap, "PSC_TAGH_TIME", trigBit,
 						taghHit->t - pscHit->t);
-				histoMap["PSC_TAGH_ENERGY"][trigBit]->Fill(taghHit->E);
+				fillHisto(referenceHistoMap, "PSC_TAGH_ENERGY", trigBit,
+						taghHit->E);
+			}
+		}
+	}
+	return NOERROR;
+}
+
+// Reference for the PSC pairs: every north/south combination inside the
+// coincidence window is a candidate, the candidates are accepted closest first
+// unless one of their hits is already paired.
+jerror_t JEventProcessor_PSvsTAC_Calibration::fillHistosPSPairsReference(
+		jana::JEventLoop* eventLoop, uint32_t trigBit) {
+	vector<const DPSCHit*> pscHitVector;
+	eventLoop->Get(pscHitVector);
+
+	vector<PSCPairCandidate> candidateVector;
+	for (auto& northHit : pscHitVector) {
+		if (northHit == nullptr || !northHit->has_TDC
+				|| northHit->arm != DPSGeometry::kNorth)
+			continue;
+		for (auto& southHit : pscHitVector) {
+			if (southHit == nullptr || !southHit->has_TDC
+					|| southHit->arm == DPSGeometry::kNorth)
+				continue;
+			double absDeltaT = fabs(northHit->t - southHit->t);
+			if (absDeltaT < psPairWindow)
+				candidateVector.push_back(
+						PSCPairCandidate { absDeltaT, northHit, southHit, 0, 0 });
+		}
+	}
+	sort(candidateVector.begin(), candidateVector.end());
+
+	set<const DPSCHit*> pairedHits;
+	vector<pair<const DPSCHit*, const DPSCHit*> > pairVector;
+	for (auto& candidate : candidateVector) {
+		if (pairedHits.count(candidate.northHit) > 0
+				|| pairedHits.count(candidate.southHit) > 0)
+			continue;
+		pairedHits.insert(candidate.northHit);
+		pairedHits.insert(candidate.southHit);
+		pairVector.push_back(make_pair(candidate.northHit, candidate.southHit));
+	}
+
+	{
+		volatile WriteLock rootRWLock(
+				*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+		fillHisto(referenceHistoMap, "PSC_PAIR_NPAIRS", trigBit,
+				(double) pairVector.size());
+	}
+
+	const DRFTime* rfTimeObjectPSC;
+	eventLoop->GetSingle(rfTimeObjectPSC, "PSC", true);
+	vector<const DTAGHHit*> taghHitVector;
+	eventLoop->Get(taghHitVector);
+
+	for (auto& pscPair : pairVector) {
+		double pairTime = 0.5 * (pscPair.first->t + pscPair.second->t);
+		const DTAGHHit* taghBestHit = nullptr;
+		const DTAGHHit* taghWorstMatch = nullptr;
+		findTAGHMatchesReference(pairTime, taghHitVector, taghBestHit,
+				taghWorstMatch);
+
+		volatile WriteLock rootRWLock(
+				*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+		fillHisto(referenceHistoMap, "PSC_PAIR_TIME", trigBit, pairTime);
+		fillHisto(referenceHistoMap, "PSC_PAIR_DT", trigBit,
+				pscPair.first->t - pscPair.second->t);
+		if (rfTimeObjectPSC != nullptr)
+			fillHisto(referenceHistoMap, "PSC_PAIR_RF_TIME", trigBit,
+					pairTime - rfTimeObjectPSC->dTime);
+		for (auto& taghHit : taghHitVector) {
+			if (taghHit != nullptr)
+				fillHisto(referenceHistoMap, "PSC_PAIR_TAGH_TIME", trigBit,
+						taghHit->t - pairTime);
+		}
+		if (taghBestHit != nullptr) {
+			fillHisto(referenceHistoMap, "PSC_PAIR_TAGH_ENERGY_MATCHED",
+					trigBit, taghBestHit->E);
+			fillHisto(referenceHistoMap, "PSC_PAIR_TAGH_ID_MATCHED", trigBit,
+					taghBestHit->counter_id);
+			fillHisto(referenceHistoMap, "PSC_PAIR_TAGH_TIME_MATCHED", trigBit,
+					taghBestHit->t - pairTime);
+		}
+		if (taghWorstMatch != nullptr) {
+			fillHisto(referenceHistoMap, "PSC_PAIR_TAGH_ENERGY_UNMATCHED",
+					trigBit, taghWorstMatch->E);
+			fillHisto(referenceHistoMap, "PSC_PAIR_TAGH_ID_UNMATCHED", trigBit,
+					taghWorstMatch->counter_id);
+			fillHisto(referenceHistoMap, "PSC_PAIR_TAGH_TIME_UNMATCHED",
+					trigBit, taghWorstMatch->t - pairTime);
+		}
+	}
+	return NOERROR;
+}
+
+// Create the histograms for the validation of the fill path. Every histogram
+// filled by the reference implementation gets two empty copies, one for the
+// reference and one for the optimized fills of the sampled events.
+void JEventProcessor_PSvsTAC_Calibration::createValidationHistograms() {
+	vector<string> histKeyVector = referenceHistoKeys;
+	// The threshold scan is checked at TAC:THRESHOLD against a direct cut on
+	// the TAC energy. Both agree only if the threshold is on a bin edge of the
+	// scan counters.
+	if (count(tacScanThresholds.begin(), tacScanThresholds.end(),
+			tacThreshold) > 0 && tacThreshold % tacScanBinWidth == 0) {
+		histKeyVector.push_back(
+				"TAC_TAGH_ID_MATCHED" + thresholdScanSuffix(tacThreshold));
+		histKeyVector.push_back(
+				"TAC_TAGH_ID_UNMATCHED" + thresholdScanSuffix(tacThreshold));
+		for (auto& scanIter : thresholdScanMap) {
+			size_t scanSize = scanIter.second.matched.size();
+			validationThresholdScanMap[scanIter.first].matched.assign(scanSize,
+					0);
+			validationThresholdScanMap[scanIter.first].accidental.assign(
+					scanSize, 0);
+		}
+	}
+	for (auto& histKey : histKeyVector) {
+		if (histoMap.count(histKey) == 0)
+			continue;
+		for (auto& histTrigIter : histoMap[histKey]) {
+			auto trigBit = histTrigIter.first;
+			auto histPointer = histTrigIter.second;
+			string histName = histPointer->GetName();
+			TH1* validationHist = dynamic_cast<TH1*>(histPointer->Clone(
+					(histName + "_VALIDATION").c_str()));
+			TH1* referenceHist = dynamic_cast<TH1*>(histPointer->Clone(
+					(histName + "_REFERENCE").c_str()));
+			validationHist->SetDirectory(nullptr);
+			referenceHist->SetDirectory(nullptr);
+			validationHist->Reset();
+			referenceHist->Reset();
+			validationHistoMap[histKey][trigBit] = validationHist;
+			referenceHistoMap[histKey][trigBit] = referenceHist;
+		}
+	}
+}
+
+// Compare the optimized and the reference histograms bin by bin, report the
+// differences and clear both sets for the next run.
+unsigned JEventProcessor_PSvsTAC_Calibration::compareValidationHistograms() {
+	volatile WriteLock rootRWLock(
+			*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+	fillThresholdScanHistos(validationThresholdScanMap, validationHistoMap);
+	for (auto& scanIter : validationThresholdScanMap) {
+		fill(scanIter.second.matched.begin(), scanIter.second.matched.end(), 0);
+		fill(scanIter.second.accidental.begin(),
+				scanIter.second.accidental.end(), 0);
+	}
+	unsigned nBadHistos = 0;
+	for (auto& histNameIter : referenceHistoMap) {
+		auto& histKey = histNameIter.first;
+		for (auto& histTrigIter : histNameIter.second) {
+			auto trigBit = histTrigIter.first;
+			TH1* referenceHist = histTrigIter.second;
+			TH1* validationHist = validationHistoMap[histKey][trigBit];
+			unsigned nBadBins = 0;
+			for (int iCell = 0; iCell < referenceHist->GetNcells(); iCell++) {
+				double refContent = referenceHist->GetBinContent(iCell);
+				double valContent = validationHist->GetBinContent(iCell);
+				double scale = max(1.0, max(fabs(refContent), fabs(valContent)));
+				if (fabs(refContent - valContent) <= validationTolerance * scale)
+					continue;
+				if (nBadBins < 5)
+					cout << "Validation mismatch in " << referenceHist->GetName()
+							<< " bin " << iCell << " : reference " << refContent
+							<< " , optimized " << valContent << endl;
+				nBadBins++;
 			}
+			if (nBadBins > 0) {
+				cout << "Validation found " << nBadBins
+						<< " mismatched bins in " << referenceHist->GetName()
+						<< endl;
+				nBadHistos++;
+			}
+			referenceHist->Reset();
+			validationHist->Reset();
 		}
+	}
+	if (nBadHistos > 0) {
+		cerr << "Fill path validation failed for " << nBadHistos
+				<< " histograms" << endl;
+	} else {
+		cout << "Fill path validation found no differences" << endl;
+	}
+	return nBadHistos;
+}
+
+void JEventProcessor_PSvsTAC_Calibration::recordFill(const TH1* histPointer,
+		int cell) {
+	histoPublisher->recordFill(histPointer, cell);
+}
 
+// Send the histograms that changed since the last call to the aggregator.
+// At the end of the run the aggregator is also told that this process is done.
+jerror_t JEventProcessor_PSvsTAC_Calibration::publishHistograms(bool endOfRun) {
+	if (histoPublisher == nullptr)
+		return NOERROR;
+	// While the previous changes are still on their way to the aggregator the
+	// new ones are left for the next call, this keeps the queue short. The end
+	// of the run is always queued.
+	if (!endOfRun && histoPublisher->isBusy())
+		return NOERROR;
+
+	volatile WriteLock rootRWLock(
+			*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
+
+	// Every histogram is published again for a new run, the publisher sends
+	// its full contents with the first message of the run
+	if (publishedRunNumber != currentRunNumber) {
+		publishedHistoGeneration.clear();
+		publishedRunNumber = currentRunNumber;
+	}
+
+	fillThresholdScanHistos();
+	for (auto& histNameIter : histoMap) {
+		for (auto& histTrigIter : histNameIter.second) {
+			auto histPointer = histTrigIter.second;
+			if (publishedHistoGeneration.count(histPointer) > 0
+					&& publishedHistoGeneration[histPointer]
+							== histoGeneration[histPointer])
+				continue;
+			histoPublisher->publishHisto(currentRunNumber, histPointer);
+			publishedHistoGeneration[histPointer] = histoGeneration[histPointer];
+		}
 	}
+	if (endOfRun)
+		histoPublisher->endRun(currentRunNumber);
 	return NOERROR;
 }
 
-jerror_t JEventProcessor_PSvsTAC_Calibration::writeHistograms() {
+jerror_t JEventProcessor_PSvsTAC_Calibration::writeHistograms(bool onlyChanged) {
+	// With the aggregator the local file can be switched off
+	if (histoPublisher != nullptr && !writeLocalFile)
+		return NOERROR;
+
 	volatile WriteLock rootRWLock(
 			*dynamic_cast<DApplication*>(japp)->GetRootReadWriteLock());
 
+	// Histograms can only be updated in place in a file that already has all
+	// of them, otherwise the file is recreated with the full set.
+	bool updateFile = onlyChanged && (writtenFileName == rootFileName);
+
+	fillThresholdScanHistos();
+
 	TDirectory* oldDir = gDirectory;
-	TFile outFile(rootFileName.c_str(), "RECREATE");
+	TFile outFile(rootFileName.c_str(), updateFile ? "UPDATE" : "RECREATE");
+	if (outFile.IsZombie()) {
+		cerr << "Cannot open file " << rootFileName << " for writing" << endl;
+		oldDir->cd();
+		return RESOURCE_UNAVAILABLE;
+	}
 	outFile.cd();
 	for (auto& histNameIter : histoMap) {
 //		auto& histName =  histNameIter.first;
 		auto& histMapTrig = histNameIter.second;
 		for (auto& histTrigIter : histMapTrig) {
+			auto trigBit = histTrigIter.first;
 			auto histPointer = histTrigIter.second;
-			histPointer->Write();
+			if (updateFile && !isDirty(histPointer, trigBit))
+				continue;
+			histPointer->Write(nullptr, TObject::kOverwrite);
+			writtenHistoGeneration[histPointer] = histoGeneration[histPointer];
 		}
 	}
+	writtenTrigGeneration = trigGeneration;
+	writtenFileName = rootFileName;
 	outFile.Write();
 	outFile.Close();
 	oldDir->cd();
@@ -12,7 +12,12 @@
 #include <map>
 #include <vector>
 #include <iterator>
+#include <sstream>
 #include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
 
 #include <TH1.h>
 #include <TDirectory.h>
@@ -24,15 +29,53 @@
 #include <TAGGER/DTAGMHit.h>
 #include <RF/DRFTime.h>
 #include <PAIR_SPECTROMETER/DPSCHit.h>
+#include <TAC/DTACHit.h>
+
+class PSvsTACHistoPublisher;
 
 class JEventProcessor_PSvsTAC_Calibration: public jana::JEventProcessor {
 protected:
+	typedef std::map<std::string, std::map<unsigned, TH1*> > HistoMap;
+
+	// Groups of fills that can be sampled in the online mode. The core rate
+	// histograms are not part of the mask, they are always filled.
+	enum FillMask {
+		kFill2D = 0x1, kFillDiagnostic = 0x2, kFillAll = 0x3
+	};
+
 	// Map of all histograms for this monitoring plugin. the first index identifies the
 	// name of the histogram, the second index (inner) identifies the trigger bit.
-	std::map<std::string, std::map<unsigned, TH1*> > histoMap;
+	HistoMap histoMap;
+
+	// Histograms for the validation of the fill path. They are filled on the
+	// sampled events by the optimized and by the reference fill methods.
+	HistoMap validationHistoMap;
+	HistoMap referenceHistoMap;
+
+	// Dirty generation of every histogram, bumped on each fill. A histogram
+	// needs to be written when its generation differs from the written one.
+	std::unordered_map<const TH1*, uint64_t> histoGeneration;
+	std::unordered_map<const TH1*, uint64_t> writtenHistoGeneration;
+	// Dirty generation per trigger bit, lets the writer skip whole trigger bits
+	// that saw no fills since the last write.
+	std::vector<uint64_t> trigGeneration;
+	std::vector<uint64_t> writtenTrigGeneration;
+
+	// Publisher of the histogram changes to the local aggregator, nullptr
+	// when no aggregator is used
+	PSvsTACHistoPublisher* histoPublisher = nullptr;
+	// Dirty generation of every histogram when it was last published for the
+	// run publishedRunNumber
+	std::unordered_map<const TH1*, uint64_t> publishedHistoGeneration;
+	int32_t publishedRunNumber = 0;
+	// Run number the histograms are published for
+	int32_t currentRunNumber = 0;
 
 	// ROOT file name
 	std::string rootFileName = "tac_monitor.root";
+	// Name of the file that holds a complete copy of the histograms. Only
+	// this file can be updated with the changed histograms.
+	std::string writtenFileName = "";
 
 	// ROOT directory pointer
 	TDirectory* rootDir = nullptr;
@@ -46,9 +89,78 @@ protected:
 
 	// Threshold that will define when the TAC hit occurred
 	static unsigned tacThreshold;
+	// Flag to take the first and the last TAGH hit as the matched and the
+	// accidental hit instead of the closest and the furthest in time
+	static unsigned taghMatchFirstLast;
 
 	static std::string tacRebuildFunctor;
 
+	// Path of the aggregator socket, empty disables the publishing
+	static std::string aggregatorSocket;
+	// Number of events between the publications to the aggregator
+	static unsigned publishInterval;
+	// Flag to write the local ROOT file also when publishing to the aggregator
+	static unsigned writeLocalFile;
+
+	// Online mode flag and the time budget per event in microseconds
+	static unsigned onlineMode;
+	static double onlineTimeBudget;
+	// Largest prescale for the sampled fills in the online mode
+	static const unsigned maxOnlinePrescale = 1024;
+
+	// Current prescales of the 2D and diagnostic fills in the online mode
+	std::atomic<unsigned> onlinePrescale2D { 1 };
+	std::atomic<unsigned> onlinePrescaleDiagnostic { 1 };
+	// Events seen by this processor in the online mode. The sampling uses it
+	// rather than the event number, whose stride in the DAQ could alias with
+	// the prescales.
+	std::atomic<uint64_t> onlineSampleCount { 0 };
+	// Running average of the event processing time and the number of timed
+	// events, protected by the online mutex
+	double onlineAverageTime = 0;
+	uint64_t onlineEventCount = 0;
+	std::mutex onlineMutex;
+
+	// Prescale for the events used to validate the fill path, 0 disables it
+	static unsigned validationPrescale;
+	// Relative tolerance for the bin contents in the fill path validation
+	static double validationTolerance;
+	// Keys of the histograms filled by the reference fill path and compared
+	// with the current one
+	static const std::vector<std::string> referenceHistoKeys;
+
+	// Coincidence window between the north and south PSC hits
+	static double psPairWindow;
+	// Flag to fill the PS histograms from the single-arm PSC hits as well
+	static unsigned psSingleArmFill;
+
+	// Comma-separated list of TAC thresholds for the single-pass threshold
+	// scan, empty list disables the scan.
+	static std::string tacThresholdScanList;
+	// TAC thresholds of the scan in the ascending order
+	static std::vector<unsigned> tacScanThresholds;
+	// Largest accepted threshold of the scan, the top of the TAC energy range
+	static const unsigned maxScanThreshold = 10000;
+	// Width and number of the TAC energy bins of the threshold scan counters
+	static unsigned tacScanBinWidth;
+	static unsigned tacScanNumberOfBins;
+	// Number of TAGH counters kept in the threshold scan counters
+	static const unsigned numberOfTAGHCounters = 320;
+
+	// Matched and accidental TAGH counts per TAC energy bin and TAGH counter
+	// of one trigger bit, indexed as energyBin * numberOfTAGHCounters + counter,
+	// and a flag for counts not yet in the histos.
+	struct ThresholdScanCounts {
+		std::vector<uint32_t> matched;
+		std::vector<uint32_t> accidental;
+		bool changed = false;
+	};
+	typedef std::map<unsigned, ThresholdScanCounts> ThresholdScanMap;
+	// Threshold scan counters behind the histograms of histoMap, and the ones
+	// of the validation events behind validationHistoMap
+	ThresholdScanMap thresholdScanMap;
+	ThresholdScanMap validationThresholdScanMap;
+
 	// Timing cut value between the TAGH and TAC coincidence
 	static double timeCutValue_TAGH;
 	// Timing cut width between the TAGH and TAC coincidence
@@ -68,9 +180,78 @@ protected:
 	// Fill TAC-related histograms
 	virtual jerror_t fillHistosTAC(jana::JEventLoop* eventLoop,
 			uint32_t trigBit);
+	virtual jerror_t fillHistosTAC(jana::JEventLoop* eventLoop,
+			uint32_t trigBit, HistoMap& targetMap, unsigned fillMask);
 	// Fill PS-related histograms
 	virtual jerror_t fillHistosPS(jana::JEventLoop* eventLoop,
 			uint32_t trigBit);
+	virtual jerror_t fillHistosPS(jana::JEventLoop* eventLoop,
+			uint32_t trigBit, HistoMap& targetMap, unsigned fillMask);
+	// Candidate pair of north and south PSC hits inside the coincidence
+	// window. Candidates are ordered by the time difference, ties are broken
+	// by the hit addresses so that the order does not depend on how the
+	// candidates were found. The indices point into the sorted arm vectors.
+	struct PSCPairCandidate {
+		double absDeltaT;
+		const DPSCHit* northHit;
+		const DPSCHit* southHit;
+		unsigned northIndex;
+		unsigned southIndex;
+
+		bool operator<(const PSCPairCandidate& other) const {
+			if (absDeltaT != other.absDeltaT)
+				return absDeltaT < other.absDeltaT;
+			if (northHit != other.northHit)
+				return std::less<const DPSCHit*>()(northHit, other.northHit);
+			return std::less<const DPSCHit*>()(southHit, other.southHit);
+		}
+	};
+
+	// Fill PS-related histograms from the north/south PSC pairs
+	virtual jerror_t fillHistosPSPairs(jana::JEventLoop* eventLoop,
+			uint32_t trigBit, HistoMap& targetMap, unsigned fillMask);
+
+	// Online mode: choose the fills for an event and track the processing time
+	virtual unsigned onlineFillMask();
+	virtual void updateOnlineLoad(double eventTime);
+
+	// Reference implementation of the TAC and PS fills for the validation
+	virtual jerror_t fillHistosTACReference(jana::JEventLoop* eventLoop,
+			uint32_t trigBit);
+	virtual jerror_t fillHistosPSReference(jana::JEventLoop* eventLoop,
+			uint32_t trigBit);
+	virtual jerror_t fillHistosPSPairsReference(jana::JEventLoop* eventLoop,
+			uint32_t trigBit);
+	// Create the validation histograms and compare them at the end of the run
+	virtual void createValidationHistograms();
+	virtual unsigned compareValidationHistograms();
+
+	// Find the matched and the accidental TAGH hits for a reference time,
+	// the closest and the furthest in time unless taghMatchFirstLast is set
+	static void findTAGHMatches(double refTime,
+			const std::vector<const DTAGHHit*>& taghHitVector,
+			const DTAGHHit*& taghBestHit, const DTAGHHit*& taghWorstMatch);
+	// Plain version of findTAGHMatches for the reference fill path
+	static void findTAGHMatchesReference(double refTime,
+			std::vector<const DTAGHHit*> taghHitVector,
+			const DTAGHHit*& taghBestHit, const DTAGHHit*& taghWorstMatch);
+
+	// Threshold scan: parse the thresholds, count the TAGH hits per TAC energy
+	// bin and produce the histograms for all thresholds
+	static void parseThresholdScanList();
+	virtual void recordThresholdScan(jana::JEventLoop* eventLoop,
+			const DTACHit* tacHit, ThresholdScanCounts& scanCounts);
+	virtual void fillThresholdScanHistos() {
+		fillThresholdScanHistos(thresholdScanMap, histoMap);
+	}
+	virtual void fillThresholdScanHistos(ThresholdScanMap& scanMap,
+			HistoMap& targetMap);
+	// Key suffix of the threshold scan histograms for a threshold
+	static std::string thresholdScanSuffix(unsigned threshold) {
+		std::stringstream thrSuffix;
+		thrSuffix << "_THR" << threshold;
+		return thrSuffix.str();
+	}
 
 	// Method where the histograms are created
 	virtual jerror_t createHistograms();
@@ -87,8 +268,63 @@ protected:
 			int nBinsX, double xMin, double xMax, int nBinsY, double yMin,
 			double yMax);
 
-	// Write histograms into the file
-	virtual jerror_t writeHistograms();
+	// Write histograms into the file. With onlyChanged the existing file is
+	// updated in place with the histograms filled since the last write.
+	virtual jerror_t writeHistograms(bool onlyChanged = true);
+	// Send the histogram changes to the local aggregator
+	virtual jerror_t publishHistograms(bool endOfRun);
+
+	// Fill histograms from the target map and, if the target is the main
+	// map, bump their dirty generation and record the filled cell for the
+	// aggregator. Histograms missing from the target map are skipped. The
+	// ROOT lock must be held by the caller.
+	void fillHisto(HistoMap& targetMap, const std::string& histKey,
+			unsigned trigBit, double x) {
+		TH1* histPointer = findHisto(targetMap, histKey, trigBit);
+		if (histPointer == nullptr)
+			return;
+		int cell = histPointer->Fill(x);
+		if (&targetMap == &histoMap) {
+			markDirty(histPointer, trigBit);
+			if (histoPublisher != nullptr)
+				recordFill(histPointer, cell);
+		}
+	}
+	void fillHisto(HistoMap& targetMap, const std::string& histKey,
+			unsigned trigBit, double x, double y) {
+		TH1* histPointer = findHisto(targetMap, histKey, trigBit);
+		if (histPointer == nullptr)
+			return;
+		int cell = histPointer->Fill(x, y);
+		if (&targetMap == &histoMap) {
+			markDirty(histPointer, trigBit);
+			if (histoPublisher != nullptr)
+				recordFill(histPointer, cell);
+		}
+	}
+	// Pass a filled cell of a main map histogram to the publisher
+	void recordFill(const TH1* histPointer, int cell);
+	static TH1* findHisto(HistoMap& targetMap, const std::string& histKey,
+			unsigned trigBit) {
+		auto histNameIter = targetMap.find(histKey);
+		if (histNameIter == targetMap.end())
+			return nullptr;
+		auto histTrigIter = histNameIter->second.find(trigBit);
+		if (histTrigIter == histNameIter->second.end())
+			return nullptr;
+		return histTrigIter->second;
+	}
+	void markDirty(const TH1* histPointer, unsigned trigBit) {
+		histoGeneration[histPointer]++;
+		trigGeneration[trigBit]++;
+	}
+	// Check if the histogram changed since it was last written
+	bool isDirty(const TH1* histPointer, unsigned trigBit) {
+		if (trigGeneration[trigBit] == writtenTrigGeneration[trigBit])
+			return false;
+		return histoGeneration[histPointer]
+				!= writtenHistoGeneration[histPointer];
+	}
 
 	// Check if the trigger bits for the event are useful
 	static bool triggerIsUseful(const DL1Trigger* trigWords) {
@@ -0,0 +1,259 @@
+/*
+ * PSvsTACDeltaProtocol.h
+ *
+ * Binary messages exchanged over a Unix domain socket between the histogram
+ * publisher in the plugin and the local aggregator daemon. Both ends run on
+ * the same node, so numbers are sent in the native byte order.
+ *
+ * Every message is a MessageHeader followed by "length" bytes of payload.
+ */
+
+#ifndef PSVSTACDELTAPROTOCOL_H_
+#define PSVSTACDELTAPROTOCOL_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace PSvsTACDelta {
+
+const uint32_t kMagic = 0x50535441;
+const uint16_t kVersion = 1;
+
+// Default path of the aggregator socket
+const char* const kDefaultSocketPath = "/tmp/ps_vs_tac_aggregator.sock";
+
+enum MessageType {
+	kHello = 1,       // Publisher identification, sent once per connection
+	kHistoDelta = 2,  // Change of one histogram since the last message
+	kEndRun = 3       // The publisher is done with a run
+};
+
+struct MessageHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;
+	uint32_t length;
+};
+
+// Serializes the payload of a message
+class Writer {
+protected:
+	std::vector<char> buffer;
+public:
+	template<typename T>
+	void put(const T& value) {
+		const char* valueBytes = reinterpret_cast<const char*>(&value);
+		buffer.insert(buffer.end(), valueBytes, valueBytes + sizeof(T));
+	}
+	void putString(const std::string& value) {
+		put<uint32_t>(value.size());
+		buffer.insert(buffer.end(), value.begin(), value.end());
+	}
+	template<typename T>
+	void putVector(const std::vector<T>& values) {
+		put<uint32_t>(values.size());
+		const char* valueBytes = reinterpret_cast<const char*>(values.data());
+		buffer.insert(buffer.end(), valueBytes,
+				valueBytes + values.size() * sizeof(T));
+	}
+	const std::vector<char>& getBuffer() const {
+		return buffer;
+	}
+};
+
+// Reads back the payload of a message. After a read past the end of the
+// payload isGood() returns false and all values are left untouched.
+class Reader {
+protected:
+	const char* data;
+	size_t size;
+	size_t position = 0;
+	bool good = true;
+
+	bool has(size_t nBytes) {
+		if (!good || size - position < nBytes)
+			good = false;
+		return good;
+	}
+public:
+	Reader(const char* data, size_t size) :
+			data(data), size(size) {
+	}
+	template<typename T>
+	void get(T& value) {
+		if (!has(sizeof(T)))
+			return;
+		memcpy(&value, data + position, sizeof(T));
+		position += sizeof(T);
+	}
+	void getString(std::string& value) {
+		uint32_t length = 0;
+		get(length);
+		if (!has(length))
+			return;
+		value.assign(data + position, length);
+		position += length;
+	}
+	template<typename T>
+	void getVector(std::vector<T>& values) {
+		uint32_t length = 0;
+		get(length);
+		if (!has(size_t(length) * sizeof(T)))
+			return;
+		values.resize(length);
+		memcpy(values.data(), data + position, length * sizeof(T));
+		position += length * sizeof(T);
+	}
+	bool isGood() const {
+		return good;
+	}
+};
+
+// Identification of a publisher
+struct Hello {
+	std::string hostName;
+	int32_t processID = 0;
+
+	void encode(Writer& writer) const {
+		writer.putString(hostName);
+		writer.put(processID);
+	}
+	bool decode(Reader& reader) {
+		reader.getString(hostName);
+		reader.get(processID);
+		return reader.isGood();
+	}
+};
+
+// Change of a histogram since the previous message for it. Only the cells
+// that changed are sent, indexed with the ROOT global bin number. The binning
+// and titles are repeated in every message so that the aggregator can create
+// the histogram from any of them.
+struct HistoDelta {
+	int32_t runNumber = 0;
+	std::string name;
+	std::string title;
+	std::string xTitle;
+	std::string yTitle;
+	uint8_t dimension = 1;
+	int32_t nBinsX = 0;
+	double xMin = 0;
+	double xMax = 0;
+	int32_t nBinsY = 0;
+	double yMin = 0;
+	double yMax = 0;
+	std::vector<std::string> xLabels;
+	double entries = 0;
+	std::vector<uint32_t> cells;
+	std::vector<double> contents;
+	std::vector<double> sumw2;
+
+	void encode(Writer& writer) const {
+		writer.put(runNumber);
+		writer.putString(name);
+		writer.putString(title);
+		writer.putString(xTitle);
+		writer.putString(yTitle);
+		writer.put(dimension);
+		writer.put(nBinsX);
+		writer.put(xMin);
+		writer.put(xMax);
+		writer.put(nBinsY);
+		writer.put(yMin);
+		writer.put(yMax);
+		writer.put<uint32_t>(xLabels.size());
+		for (auto& label : xLabels)
+			writer.putString(label);
+		writer.put(entries);
+		writer.putVector(cells);
+		writer.putVector(contents);
+		writer.putVector(sumw2);
+	}
+	bool decode(Reader& reader) {
+		reader.get(runNumber);
+		reader.getString(name);
+		reader.getString(title);
+		reader.getString(xTitle);
+		reader.getString(yTitle);
+		reader.get(dimension);
+		reader.get(nBinsX);
+		reader.get(xMin);
+		reader.get(xMax);
+		reader.get(nBinsY);
+		reader.get(yMin);
+		reader.get(yMax);
+		uint32_t nLabels = 0;
+		reader.get(nLabels);
+		xLabels.clear();
+		for (uint32_t iLabel = 0; iLabel < nLabels && reader.isGood();
+				iLabel++) {
+			std::string label;
+			reader.getString(label);
+			xLabels.push_back(label);
+		}
+		reader.get(entries);
+		reader.getVector(cells);
+		reader.getVector(contents);
+		reader.getVector(sumw2);
+		return reader.isGood() && cells.size() == contents.size()
+				&& cells.size() == sumw2.size();
+	}
+};
+
+// End of a run for a publisher
+struct EndRun {
+	int32_t runNumber = 0;
+
+	void encode(Writer& writer) const {
+		writer.put(runNumber);
+	}
+	bool decode(Reader& reader) {
+		reader.get(runNumber);
+		return reader.isGood();
+	}
+};
+
+// Write the whole buffer into the socket, retrying on partial writes
+inline bool sendAll(int socketFD, const char* data, size_t size) {
+	while (size > 0) {
+		ssize_t nSent = send(socketFD, data, size, MSG_NOSIGNAL);
+		if (nSent < 0 && errno == EINTR)
+			continue;
+		if (nSent <= 0)
+			return false;
+		data += nSent;
+		size -= nSent;
+	}
+	return true;
+}
+
+// Build a complete message, header and payload, with the given type
+inline std::vector<char> encodeMessage(MessageType type,
+		const Writer& payload) {
+	MessageHeader header;
+	header.magic = kMagic;
+	header.version = kVersion;
+	header.type = type;
+	header.length = payload.getBuffer().size();
+	const char* headerBytes = reinterpret_cast<const char*>(&header);
+	std::vector<char> message(headerBytes, headerBytes + sizeof(header));
+	message.insert(message.end(), payload.getBuffer().begin(),
+			payload.getBuffer().end());
+	return message;
+}
+
+// Send a message with the given type and payload
+inline bool sendMessage(int socketFD, MessageType type, const Writer& payload) {
+	std::vector<char> message = encodeMessage(type, payload);
+	return sendAll(socketFD, message.data(), message.size());
+}
+
+}
+
+#endif /* PSVSTACDELTAPROTOCOL_H_ */
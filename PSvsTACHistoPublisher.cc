@@ -0,0 +1,231 @@
+/*
+ * PSvsTACHistoPublisher.cc
+ *
+ * Streams the changes of the plugin histograms to the local aggregator
+ * daemon over a Unix domain socket.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <cmath>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "TAxis.h"
+
+#include "PSvsTACHistoPublisher.h"
+
+using namespace std;
+
+PSvsTACHistoPublisher::PSvsTACHistoPublisher(const string& socketPath) :
+		socketPath(socketPath) {
+	senderThread = thread(&PSvsTACHistoPublisher::sendMessages, this);
+}
+
+PSvsTACHistoPublisher::~PSvsTACHistoPublisher() {
+	{
+		lock_guard<mutex> queueLock(queueMutex);
+		stopRequested = true;
+	}
+	queueCondition.notify_all();
+	senderThread.join();
+	closeSocket();
+}
+
+bool PSvsTACHistoPublisher::connectSocket() {
+	if (socketFD >= 0)
+		return true;
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(address.sun_path)) {
+		if (!reportedFailure)
+			cerr << "Aggregator socket path " << socketPath << " is too long"
+					<< endl;
+		reportedFailure = true;
+		return false;
+	}
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+	socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socketFD < 0)
+		return false;
+	// Do not let a stuck aggregator hold the sender thread, in particular when
+	// the publisher is destroyed. A message cut by the timeout is sent again
+	// in full after the reconnection.
+	timeval sendTimeout;
+	sendTimeout.tv_sec = 2;
+	sendTimeout.tv_usec = 0;
+	setsockopt(socketFD, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout,
+			sizeof(sendTimeout));
+	if (connect(socketFD, reinterpret_cast<sockaddr*>(&address),
+			sizeof(address)) != 0) {
+		if (!reportedFailure)
+			cerr << "Cannot connect to the aggregator at " << socketPath
+					<< " , will retry" << endl;
+		reportedFailure = true;
+		closeSocket();
+		return false;
+	}
+
+	PSvsTACDelta::Hello hello;
+	char hostName[256] = "";
+	gethostname(hostName, sizeof(hostName) - 1);
+	hello.hostName = hostName;
+	hello.processID = getpid();
+	PSvsTACDelta::Writer writer;
+	hello.encode(writer);
+	if (!PSvsTACDelta::sendMessage(socketFD, PSvsTACDelta::kHello, writer)) {
+		closeSocket();
+		return false;
+	}
+	cout << "Connected to the aggregator at " << socketPath << endl;
+	reportedFailure = false;
+	return true;
+}
+
+void PSvsTACHistoPublisher::closeSocket() {
+	if (socketFD >= 0)
+		close(socketFD);
+	socketFD = -1;
+}
+
+void PSvsTACHistoPublisher::queueMessage(PSvsTACDelta::MessageType type,
+		const PSvsTACDelta::Writer& payload) {
+	{
+		lock_guard<mutex> queueLock(queueMutex);
+		messageQueue.push_back(PSvsTACDelta::encodeMessage(type, payload));
+	}
+	queueCondition.notify_one();
+}
+
+bool PSvsTACHistoPublisher::isBusy() {
+	lock_guard<mutex> queueLock(queueMutex);
+	return messageQueue.size() > 0;
+}
+
+// Send the queued messages in order. A message that could not be sent stays
+// at the front of the queue and is sent again after a reconnection, the
+// aggregator drops the incomplete message of a broken connection. When the
+// publisher is destroyed the rest of the queue is dropped at the first failure.
+void PSvsTACHistoPublisher::sendMessages() {
+	unique_lock<mutex> queueLock(queueMutex);
+	while (true) {
+		queueCondition.wait(queueLock,
+				[this] {return stopRequested || messageQueue.size() > 0;});
+		if (messageQueue.size() == 0)
+			return;
+
+		// Only this thread removes messages, so the front one stays valid
+		// while the queue is unlocked
+		const vector<char>& message = messageQueue.front();
+		queueLock.unlock();
+		bool sent = connectSocket()
+				&& PSvsTACDelta::sendAll(socketFD, message.data(),
+						message.size());
+		if (!sent && socketFD >= 0) {
+			cerr << "Lost connection to the aggregator at " << socketPath
+					<< " , will retry" << endl;
+			closeSocket();
+		}
+		queueLock.lock();
+
+		if (sent) {
+			messageQueue.pop_front();
+			continue;
+		}
+		if (stopRequested) {
+			cerr << "Dropping " << messageQueue.size()
+					<< " messages for the aggregator at " << socketPath << endl;
+			messageQueue.clear();
+			return;
+		}
+		queueCondition.wait_for(queueLock, chrono::seconds(1),
+				[this] {return stopRequested;});
+	}
+}
+
+void PSvsTACHistoPublisher::recordChange(const TH1* histPointer, int cell,
+		double contentDelta, double sumw2Delta) {
+	if (cell < 0)
+		return;
+	auto changesIter = histoChangesMap.find(histPointer);
+	if (changesIter == histoChangesMap.end())
+		return;
+	auto& cellChange = changesIter->second.cellChanges[cell];
+	cellChange.first += contentDelta;
+	cellChange.second += sumw2Delta;
+}
+
+void PSvsTACHistoPublisher::publishHisto(int runNumber,
+		const TH1* histPointer) {
+	PSvsTACDelta::HistoDelta delta;
+	delta.runNumber = runNumber;
+	delta.name = histPointer->GetName();
+	delta.title = histPointer->GetTitle();
+	delta.dimension = histPointer->GetDimension();
+	const TAxis* xAxis = histPointer->GetXaxis();
+	const TAxis* yAxis = histPointer->GetYaxis();
+	delta.xTitle = xAxis->GetTitle();
+	delta.yTitle = yAxis->GetTitle();
+	delta.nBinsX = xAxis->GetNbins();
+	delta.xMin = xAxis->GetXmin();
+	delta.xMax = xAxis->GetXmax();
+	delta.nBinsY = yAxis->GetNbins();
+	delta.yMin = yAxis->GetXmin();
+	delta.yMax = yAxis->GetXmax();
+	if (xAxis->GetLabels() != nullptr) {
+		for (int iBin = 1; iBin <= delta.nBinsX; iBin++)
+			delta.xLabels.push_back(xAxis->GetBinLabel(iBin));
+	}
+
+	HistoChanges& histoChanges = histoChangesMap[histPointer];
+	double entries = histPointer->GetEntries();
+	if (histoChanges.runNumber != runNumber) {
+		// The histograms of the plugin are not reset between runs, the first
+		// message of the run carries the full histogram so that the merged
+		// file holds the same cumulative histograms as the local file of the
+		// run. It is always sent, so that the aggregator knows about the
+		// histogram even if it is empty.
+		const TArrayD* sumw2Array = histPointer->GetSumw2();
+		bool hasSumw2 = histPointer->GetSumw2N() > 0;
+		for (int iCell = 0; iCell < histPointer->GetNcells(); iCell++) {
+			double content = histPointer->GetBinContent(iCell);
+			double sumw2 = hasSumw2 ? sumw2Array->fArray[iCell] : fabs(content);
+			if (content == 0 && sumw2 == 0)
+				continue;
+			delta.cells.push_back(iCell);
+			delta.contents.push_back(content);
+			delta.sumw2.push_back(sumw2);
+		}
+		delta.entries = entries;
+		histoChanges.runNumber = runNumber;
+	} else {
+		for (auto& cellIter : histoChanges.cellChanges) {
+			delta.cells.push_back(cellIter.first);
+			delta.contents.push_back(cellIter.second.first);
+			delta.sumw2.push_back(cellIter.second.second);
+		}
+		delta.entries = entries - histoChanges.publishedEntries;
+		if (delta.cells.size() == 0 && delta.entries == 0)
+			return;
+	}
+	histoChanges.cellChanges.clear();
+	histoChanges.publishedEntries = entries;
+
+	PSvsTACDelta::Writer writer;
+	delta.encode(writer);
+	queueMessage(PSvsTACDelta::kHistoDelta, writer);
+}
+
+void PSvsTACHistoPublisher::endRun(int runNumber) {
+	PSvsTACDelta::EndRun endRunMessage;
+	endRunMessage.runNumber = runNumber;
+	PSvsTACDelta::Writer writer;
+	endRunMessage.encode(writer);
+	queueMessage(PSvsTACDelta::kEndRun, writer);
+}
@@ -0,0 +1,101 @@
+/*
+ * PSvsTACHistoPublisher.h
+ *
+ * Streams the changes of the plugin histograms to the local aggregator
+ * daemon over a Unix domain socket.
+ *
+ * The changed cells are recorded at fill time by the caller, which holds the
+ * ROOT lock, and queued when the histogram is published. Only the first
+ * message of a run goes through all cells of the histogram. A sender thread
+ * connects to the aggregator and sends the queued messages, so a slow or
+ * missing aggregator never blocks the event processing.
+ */
+
+#ifndef PSVSTACHISTOPUBLISHER_H_
+#define PSVSTACHISTOPUBLISHER_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include <TH1.h>
+
+#include "PSvsTACDeltaProtocol.h"
+
+class PSvsTACHistoPublisher {
+protected:
+	// Path of the aggregator socket
+	std::string socketPath;
+	// Socket descriptor, negative when not connected. Only used by the sender
+	// thread.
+	int socketFD = -1;
+	// Flag to report a failed connection only once until it works again
+	bool reportedFailure = false;
+
+	// Changes of a histogram since it was last queued for the aggregator: the
+	// run it was last queued for, its entries then, and the content and the
+	// squared error changes of the cells filled since.
+	struct HistoChanges {
+		int runNumber = 0;
+		double publishedEntries = 0;
+		std::unordered_map<int, std::pair<double, double> > cellChanges;
+	};
+	// Only the histograms that were already published are tracked, the first
+	// message of a run carries the full histogram anyway.
+	std::unordered_map<const TH1*, HistoChanges> histoChangesMap;
+
+	// Encoded messages waiting for the sender thread, oldest first. A message
+	// stays in the queue until it was sent completely.
+	std::deque<std::vector<char> > messageQueue;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stopRequested = false;
+	std::thread senderThread;
+
+	void queueMessage(PSvsTACDelta::MessageType type,
+			const PSvsTACDelta::Writer& payload);
+	// Body of the sender thread
+	void sendMessages();
+	// Connect to the aggregator and introduce this process if not connected yet
+	bool connectSocket();
+	void closeSocket();
+
+public:
+	PSvsTACHistoPublisher(const std::string& socketPath);
+	// Sends what is still queued if the aggregator can be reached
+	virtual ~PSvsTACHistoPublisher();
+
+	// Flag for messages that were not sent yet
+	bool isBusy();
+	// Record the change of one cell of a histogram, cell is the global bin
+	// number returned by Fill(). Needs the ROOT lock.
+	void recordChange(const TH1* histPointer, int cell, double contentDelta,
+			double sumw2Delta);
+	void recordFill(const TH1* histPointer, int cell, double weight = 1) {
+		recordChange(histPointer, cell, weight, weight * weight);
+	}
+	// Record a cell set by SetBinContent(), which changes the squared error
+	// only for histograms without Sumw2
+	void recordContentChange(const TH1* histPointer, int cell,
+			double contentDelta) {
+		recordChange(histPointer, cell, contentDelta,
+				histPointer->GetSumw2N() > 0 ? 0 : contentDelta);
+	}
+	// Queue the change of the histogram since it was last queued for this
+	// run, or the full histogram the first time in the run. Needs the ROOT
+	// lock, does no I/O.
+	void publishHisto(int runNumber, const TH1* histPointer);
+	// Tell the aggregator that this process is done with the run
+	void endRun(int runNumber);
+
+	const std::string& getSocketPath() const {
+		return socketPath;
+	}
+};
+
+#endif /* PSVSTACHISTOPUBLISHER_H_ */
@@ -0,0 +1,527 @@
+/*
+ * ps_vs_tac_aggregator.cc
+ *
+ * Local aggregator for the PSvsTAC_Calibration plugin. Several JANA processes
+ * on the same node publish the changes of their histograms over a Unix domain
+ * socket (TAC:AGGREGATOR_SOCKET). The aggregator adds them into one merged set
+ * of histograms per run and writes a single ps_vs_tac_calib_<run>.root once
+ * every process that contributed to the run has finished it.
+ *
+ * Publishers are known by their host name and process ID. A publisher that
+ * loses its connection can reconnect and continue its runs, a lost connection
+ * does not finish them. A run whose unfinished publishers are all gone is
+ * written after the grace time without data.
+ *
+ * A written run is dropped from memory after the grace time. Data that comes
+ * for it later is added to the histograms loaded back from its file. A file
+ * that was not written by this aggregator is never overwritten, the run is
+ * then written into ps_vs_tac_calib_<run>_<n>.root with the first free n.
+ *
+ * Usage: ps_vs_tac_aggregator [-s socket_path] [-o output_dir] [-g grace_seconds]
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <csignal>
+#include <cstdlib>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "TFile.h"
+#include "TKey.h"
+#include "TList.h"
+#include "TH1.h"
+#include "TH1D.h"
+#include "TH2D.h"
+
+#include "PSvsTACDeltaProtocol.h"
+
+using namespace std;
+
+// Messages larger than this are treated as garbage
+static const uint32_t maxMessageLength = 512 * 1024 * 1024;
+// Largest number of cells of a merged histogram
+static const uint64_t maxCells = 64 * 1024 * 1024;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+	stopRequested = 1;
+}
+
+// A connected publisher, the name is set by its hello message
+struct ClientState {
+	string name;
+	vector<char> buffer;
+};
+
+// Merged histograms of one run
+struct RunState {
+	// File the run is written into
+	string fileName;
+	map<string, TH1*> histoMap;
+	map<string, double> entriesMap;
+	// Names of the publishers that sent data for the run and did not finish
+	// it yet
+	set<string> openClients;
+	// Flag for the data received since the file was last written
+	bool changed = false;
+	time_t lastActivity = 0;
+
+	~RunState() {
+		for (auto& histIter : histoMap)
+			delete histIter.second;
+	}
+};
+
+class Aggregator {
+protected:
+	string socketPath;
+	string outputDir;
+	int graceTime;
+	int listenFD = -1;
+	map<int, ClientState> clientMap;
+	map<int, RunState> runMap;
+	// Files written by this aggregator for each run, also for the runs that
+	// were dropped from memory
+	map<int, string> writtenFileMap;
+
+	void acceptClient();
+	void disconnectClient(int clientFD);
+	bool readClient(int clientFD);
+	bool processMessage(int clientFD, uint16_t type, const char* payload,
+			uint32_t length);
+	RunState& getRun(int runNumber);
+	string newFileName(int runNumber);
+	bool loadRun(RunState& runState);
+	void addDelta(const string& clientName,
+			const PSvsTACDelta::HistoDelta& delta);
+	void finishRun(int runNumber, const string& clientName);
+	void writeRun(int runNumber);
+	bool isConnected(const string& clientName);
+	void dropIdleRuns();
+
+public:
+	Aggregator(const string& socketPath, const string& outputDir,
+			int graceTime) :
+			socketPath(socketPath), outputDir(outputDir), graceTime(graceTime) {
+	}
+	bool open();
+	void run();
+	void close();
+};
+
+bool Aggregator::open() {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(address.sun_path)) {
+		cerr << "Socket path " << socketPath << " is too long" << endl;
+		return false;
+	}
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+	listenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFD < 0) {
+		perror("socket");
+		return false;
+	}
+	unlink(socketPath.c_str());
+	if (bind(listenFD, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+			!= 0 || listen(listenFD, 64) != 0) {
+		perror(socketPath.c_str());
+		return false;
+	}
+	cout << "Aggregator is listening on " << socketPath << endl;
+	return true;
+}
+
+void Aggregator::run() {
+	while (!stopRequested) {
+		vector<pollfd> pollVector;
+		pollVector.push_back(pollfd { listenFD, POLLIN, 0 });
+		for (auto& clientIter : clientMap)
+			pollVector.push_back(pollfd { clientIter.first, POLLIN, 0 });
+		int nReady = poll(pollVector.data(), pollVector.size(), 1000);
+		if (nReady < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		for (auto& pollEntry : pollVector) {
+			if (pollEntry.revents == 0)
+				continue;
+			if (pollEntry.fd == listenFD)
+				acceptClient();
+			else if (!readClient(pollEntry.fd))
+				disconnectClient(pollEntry.fd);
+		}
+		dropIdleRuns();
+	}
+}
+
+void Aggregator::close() {
+	for (auto& clientIter : clientMap)
+		::close(clientIter.first);
+	clientMap.clear();
+	// Write whatever was collected for the runs that are not finished
+	for (auto& runIter : runMap) {
+		if (runIter.second.changed)
+			writeRun(runIter.first);
+	}
+	runMap.clear();
+	if (listenFD >= 0) {
+		::close(listenFD);
+		unlink(socketPath.c_str());
+	}
+	listenFD = -1;
+}
+
+void Aggregator::acceptClient() {
+	int clientFD = accept(listenFD, nullptr, nullptr);
+	if (clientFD < 0)
+		return;
+	clientMap[clientFD].name = "";
+}
+
+// The runs of the publisher stay open, it may reconnect and continue them.
+// Its incomplete message, if any, is dropped and sent again by the publisher.
+void Aggregator::disconnectClient(int clientFD) {
+	cout << "Publisher " << clientMap[clientFD].name << " disconnected"
+			<< endl;
+	::close(clientFD);
+	clientMap.erase(clientFD);
+}
+
+bool Aggregator::isConnected(const string& clientName) {
+	for (auto& clientIter : clientMap) {
+		if (clientIter.second.name == clientName)
+			return true;
+	}
+	return false;
+}
+
+// Read the available data from the publisher and process all complete
+// messages. Returns false if the publisher has to be disconnected.
+bool Aggregator::readClient(int clientFD) {
+	auto& buffer = clientMap[clientFD].buffer;
+	char readBuffer[65536];
+	ssize_t nRead = recv(clientFD, readBuffer, sizeof(readBuffer), 0);
+	if (nRead < 0 && errno == EINTR)
+		return true;
+	if (nRead <= 0)
+		return false;
+	buffer.insert(buffer.end(), readBuffer, readBuffer + nRead);
+
+	size_t position = 0;
+	while (buffer.size() - position >= sizeof(PSvsTACDelta::MessageHeader)) {
+		PSvsTACDelta::MessageHeader header;
+		memcpy(&header, buffer.data() + position, sizeof(header));
+		if (header.magic != PSvsTACDelta::kMagic
+				|| header.version != PSvsTACDelta::kVersion
+				|| header.length > maxMessageLength) {
+			cerr << "Bad message from publisher " << clientMap[clientFD].name
+					<< endl;
+			return false;
+		}
+		if (buffer.size() - position < sizeof(header) + header.length)
+			break;
+		if (!processMessage(clientFD, header.type,
+				buffer.data() + position + sizeof(header), header.length))
+			return false;
+		position += sizeof(header) + header.length;
+	}
+	buffer.erase(buffer.begin(), buffer.begin() + position);
+	return true;
+}
+
+bool Aggregator::processMessage(int clientFD, uint16_t type,
+		const char* payload, uint32_t length) {
+	PSvsTACDelta::Reader reader(payload, length);
+	const string& clientName = clientMap[clientFD].name;
+	if (type != PSvsTACDelta::kHello && clientName.size() == 0) {
+		cerr << "Message type " << type << " before the hello message" << endl;
+		return false;
+	}
+	switch (type) {
+	case PSvsTACDelta::kHello: {
+		PSvsTACDelta::Hello hello;
+		if (!hello.decode(reader))
+			return false;
+		stringstream nameStream;
+		nameStream << hello.hostName << ":" << hello.processID;
+		clientMap[clientFD].name = nameStream.str();
+		cout << "Publisher " << nameStream.str() << " connected" << endl;
+		return true;
+	}
+	case PSvsTACDelta::kHistoDelta: {
+		PSvsTACDelta::HistoDelta delta;
+		if (!delta.decode(reader))
+			return false;
+		addDelta(clientName, delta);
+		return true;
+	}
+	case PSvsTACDelta::kEndRun: {
+		PSvsTACDelta::EndRun endRun;
+		if (!endRun.decode(reader))
+			return false;
+		cout << "Publisher " << clientName << " finished run "
+				<< endRun.runNumber << endl;
+		finishRun(endRun.runNumber, clientName);
+		return true;
+	}
+	default:
+		cerr << "Unknown message type " << type << " from publisher "
+				<< clientName << endl;
+		return false;
+	}
+}
+
+// Find the merged histograms of a run, or start them. A run that was already
+// written and dropped continues from its file.
+RunState& Aggregator::getRun(int runNumber) {
+	auto runIter = runMap.find(runNumber);
+	if (runIter != runMap.end())
+		return runIter->second;
+
+	RunState& runState = runMap[runNumber];
+	auto fileIter = writtenFileMap.find(runNumber);
+	if (fileIter == writtenFileMap.end()) {
+		runState.fileName = newFileName(runNumber);
+		return runState;
+	}
+	runState.fileName = fileIter->second;
+	if (!loadRun(runState)) {
+		runState.fileName = newFileName(runNumber);
+		cerr << "Cannot load run " << runNumber << " from " << fileIter->second
+				<< " , merging its new data into " << runState.fileName
+				<< endl;
+	}
+	return runState;
+}
+
+// Name of the file for a run that does not overwrite an existing file
+string Aggregator::newFileName(int runNumber) {
+	stringstream fileNameStream;
+	fileNameStream << outputDir << "/ps_vs_tac_calib_" << runNumber << ".root";
+	if (access(fileNameStream.str().c_str(), F_OK) != 0)
+		return fileNameStream.str();
+	string oldFileName = fileNameStream.str();
+	for (int fileIndex = 1; access(fileNameStream.str().c_str(), F_OK) == 0;
+			fileIndex++) {
+		fileNameStream.str("");
+		fileNameStream << outputDir << "/ps_vs_tac_calib_" << runNumber << "_"
+				<< fileIndex << ".root";
+	}
+	cerr << "File " << oldFileName << " already exists, run " << runNumber
+			<< " will be written into " << fileNameStream.str() << endl;
+	return fileNameStream.str();
+}
+
+// Read the merged histograms of a run back from its file
+bool Aggregator::loadRun(RunState& runState) {
+	TFile inFile(runState.fileName.c_str(), "READ");
+	if (inFile.IsZombie())
+		return false;
+	TIter keyIter(inFile.GetListOfKeys());
+	while (TKey* key = dynamic_cast<TKey*>(keyIter())) {
+		TObject* object = key->ReadObj();
+		TH1* histPointer = dynamic_cast<TH1*>(object);
+		if (histPointer == nullptr || runState.histoMap.count(
+				histPointer->GetName()) > 0) {
+			delete object;
+			continue;
+		}
+		histPointer->SetDirectory(nullptr);
+		runState.histoMap[histPointer->GetName()] = histPointer;
+		runState.entriesMap[histPointer->GetName()] = histPointer->GetEntries();
+	}
+	cout << "Loaded " << runState.histoMap.size() << " histograms from "
+			<< runState.fileName << endl;
+	return true;
+}
+
+// Add the change of one histogram to the merged histogram of its run. The
+// whole message is checked before anything is added, a delta that does not
+// fit the histogram is dropped.
+void Aggregator::addDelta(const string& clientName,
+		const PSvsTACDelta::HistoDelta& delta) {
+	RunState& runState = getRun(delta.runNumber);
+	runState.openClients.insert(clientName);
+	runState.lastActivity = time(nullptr);
+
+	// Number of cells of the histogram described by the delta, including the
+	// underflow and overflow bins
+	uint64_t nCells = 0;
+	if (delta.dimension == 1 && delta.nBinsX > 0)
+		nCells = uint64_t(delta.nBinsX) + 2;
+	else if (delta.dimension == 2 && delta.nBinsX > 0 && delta.nBinsY > 0)
+		nCells = (uint64_t(delta.nBinsX) + 2) * (uint64_t(delta.nBinsY) + 2);
+	if (nCells == 0 || nCells > maxCells) {
+		cerr << "Bad binning of " << delta.name << " from publisher "
+				<< clientName << endl;
+		return;
+	}
+	for (auto cell : delta.cells) {
+		if (cell >= nCells) {
+			cerr << "Cell " << cell << " of " << delta.name
+					<< " from publisher " << clientName << " is out of range"
+					<< endl;
+			return;
+		}
+	}
+
+	TH1*& histPointer = runState.histoMap[delta.name];
+	if (histPointer == nullptr) {
+		if (delta.dimension == 2)
+			histPointer = new TH2D(delta.name.c_str(), delta.title.c_str(),
+					delta.nBinsX, delta.xMin, delta.xMax, delta.nBinsY,
+					delta.yMin, delta.yMax);
+		else
+			histPointer = new TH1D(delta.name.c_str(), delta.title.c_str(),
+					delta.nBinsX, delta.xMin, delta.xMax);
+		histPointer->SetDirectory(nullptr);
+		histPointer->Sumw2();
+		histPointer->GetXaxis()->SetTitle(delta.xTitle.c_str());
+		histPointer->GetYaxis()->SetTitle(delta.yTitle.c_str());
+		for (unsigned iLabel = 0; iLabel < delta.xLabels.size(); iLabel++) {
+			if (delta.xLabels[iLabel].size() > 0)
+				histPointer->GetXaxis()->SetBinLabel(iLabel + 1,
+						delta.xLabels[iLabel].c_str());
+		}
+	} else if (histPointer->GetDimension() != delta.dimension
+			|| histPointer->GetXaxis()->GetNbins() != delta.nBinsX
+			|| (delta.dimension == 2
+					&& histPointer->GetYaxis()->GetNbins() != delta.nBinsY)) {
+		cerr << "Binning of " << delta.name << " from publisher " << clientName
+				<< " does not match" << endl;
+		return;
+	}
+
+	// Both TH1D and TH2D keep their bin contents in a TArrayD
+	TArrayD* contentArray = dynamic_cast<TArrayD*>(histPointer);
+	TArrayD* sumw2Array = histPointer->GetSumw2();
+	if (contentArray == nullptr || sumw2Array == nullptr
+			|| uint64_t(contentArray->GetSize()) != nCells
+			|| uint64_t(sumw2Array->GetSize()) != nCells) {
+		cerr << "Cannot add to histogram " << delta.name << endl;
+		return;
+	}
+	for (unsigned iCell = 0; iCell < delta.cells.size(); iCell++) {
+		uint32_t cell = delta.cells[iCell];
+		contentArray->fArray[cell] += delta.contents[iCell];
+		sumw2Array->fArray[cell] += delta.sumw2[iCell];
+	}
+	runState.entriesMap[delta.name] += delta.entries;
+	runState.changed = true;
+}
+
+// The publisher will not send more data for the run. Once no publisher is
+// left the merged histograms are written out.
+void Aggregator::finishRun(int runNumber, const string& clientName) {
+	auto runIter = runMap.find(runNumber);
+	if (runIter == runMap.end())
+		return;
+	RunState& runState = runIter->second;
+	runState.openClients.erase(clientName);
+	runState.lastActivity = time(nullptr);
+	if (runState.openClients.size() == 0 && runState.changed)
+		writeRun(runNumber);
+}
+
+void Aggregator::writeRun(int runNumber) {
+	RunState& runState = runMap[runNumber];
+	TFile outFile(runState.fileName.c_str(), "RECREATE");
+	if (outFile.IsZombie()) {
+		cerr << "Cannot open file " << runState.fileName << " for writing"
+				<< endl;
+		return;
+	}
+	outFile.cd();
+	for (auto& histIter : runState.histoMap) {
+		auto histPointer = histIter.second;
+		histPointer->ResetStats();
+		histPointer->SetEntries(runState.entriesMap[histIter.first]);
+		histPointer->Write();
+	}
+	outFile.Close();
+	runState.changed = false;
+	writtenFileMap[runNumber] = runState.fileName;
+	cout << "Wrote " << runState.histoMap.size() << " histograms into "
+			<< runState.fileName << endl;
+}
+
+// Write the runs whose unfinished publishers are all disconnected and sent
+// no data for the grace time, and drop the runs that were written and saw
+// no publisher for the grace time. Data for a dropped run is merged into the
+// histograms loaded back from its file.
+void Aggregator::dropIdleRuns() {
+	time_t now = time(nullptr);
+	for (auto runIter = runMap.begin(); runIter != runMap.end();) {
+		RunState& runState = runIter->second;
+		if (runState.openClients.size() > 0
+				&& now - runState.lastActivity > graceTime) {
+			bool anyConnected = false;
+			for (auto& clientName : runState.openClients)
+				anyConnected = anyConnected || isConnected(clientName);
+			if (!anyConnected) {
+				cerr << "Run " << runIter->first << " was not finished by "
+						<< runState.openClients.size()
+						<< " disconnected publishers, writing it" << endl;
+				runState.openClients.clear();
+				runState.lastActivity = now;
+				if (runState.changed)
+					writeRun(runIter->first);
+			}
+		}
+		if (runState.openClients.size() == 0 && !runState.changed
+				&& now - runState.lastActivity > graceTime)
+			runIter = runMap.erase(runIter);
+		else
+			runIter++;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	string socketPath = PSvsTACDelta::kDefaultSocketPath;
+	string outputDir = ".";
+	int graceTime = 300;
+	int option;
+	while ((option = getopt(argc, argv, "s:o:g:h")) != -1) {
+		switch (option) {
+		case 's':
+			socketPath = optarg;
+			break;
+		case 'o':
+			outputDir = optarg;
+			break;
+		case 'g':
+			graceTime = atoi(optarg);
+			break;
+		default:
+			cerr << "Usage: " << argv[0]
+					<< " [-s socket_path] [-o output_dir] [-g grace_seconds]"
+					<< endl;
+			return 1;
+		}
+	}
+
+	TH1::AddDirectory(false);
+	signal(SIGINT, requestStop);
+	signal(SIGTERM, requestStop);
+	signal(SIGPIPE, SIG_IGN);
+
+	Aggregator aggregator(socketPath, outputDir, graceTime);
+	if (!aggregator.open())
+		return 1;
+	aggregator.run();
+	aggregator.close();
+	return 0;
+}
@@ -0,0 +1,458 @@
+/*
+ * ps_vs_tac_publisher_test.cc
+ *
+ * Test driver for the aggregator of the PSvsTAC_Calibration plugin. It starts
+ * the aggregator and N publisher processes. Every publisher fills the same set
+ * of test histograms with its own values and publishes them for two runs
+ * through PSvsTACHistoPublisher, in several rounds per run. The histograms
+ * are not reset between the runs and one of them is filled only in the first
+ * run, like in the plugin. Then one more process sends deltas with a cell out
+ * of range and with a wrong binning over the raw protocol, which have to be
+ * dropped. The merged file of each run has to hold the sum of the histograms
+ * of all publishers.
+ *
+ * A second aggregator with a short grace time checks that a run it already
+ * wrote and dropped is continued from its file when a late publisher sends
+ * more data, and that a file it did not write is not overwritten.
+ *
+ * Usage: ps_vs_tac_publisher_test [-n publishers] [-a aggregator_program]
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <csignal>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "TFile.h"
+#include "TH1.h"
+#include "TH1D.h"
+#include "TH2D.h"
+
+#include "PSvsTACDeltaProtocol.h"
+#include "PSvsTACHistoPublisher.h"
+
+using namespace std;
+
+static const int nRuns = 2;
+static const int nRounds = 3;
+// Run published by the late publisher test
+static const int lateRunNumber = 3;
+// Time to wait for the merged files
+static const int maxWaitTime = 30;
+
+// The test histograms of one publisher
+struct TestHistos {
+	TH1D* histo1D;
+	TH2D* histo2D;
+	// Filled only in the first run
+	TH1D* histoStatic;
+
+	TestHistos() {
+		histo1D = new TH1D("TEST_1D", "Test 1D;x;counts", 10, 0, 10);
+		histo2D = new TH2D("TEST_2D", "Test 2D;x;y", 5, 0, 5, 4, 0, 4);
+		histoStatic = new TH1D("TEST_STATIC", "Test static;x;counts", 8, 0, 8);
+		for (auto histPointer : getHistos()) {
+			histPointer->SetDirectory(nullptr);
+			histPointer->Sumw2();
+		}
+	}
+	~TestHistos() {
+		for (auto histPointer : getHistos())
+			delete histPointer;
+	}
+	vector<TH1*> getHistos() const {
+		return vector<TH1*> { histo1D, histo2D, histoStatic };
+	}
+
+	// Fill the values of one publishing round and record the filled cells
+	// with the publisher, if any. The 1D values cover the underflow and
+	// overflow bins, the weights differ between publishers.
+	void fill(int iPublisher, int runNumber, int iRound,
+			PSvsTACHistoPublisher* publisher = nullptr) {
+		for (int iFill = 0; iFill < 50; iFill++) {
+			int value = iPublisher * 7 + runNumber * 5 + iRound * 3 + iFill;
+			int cell = histo1D->Fill(value % 12 - 0.5, 1 + iPublisher);
+			if (publisher != nullptr)
+				publisher->recordFill(histo1D, cell, 1 + iPublisher);
+			cell = histo2D->Fill(value % 5, (iPublisher + iFill) % 4);
+			if (publisher != nullptr)
+				publisher->recordFill(histo2D, cell);
+		}
+		if (runNumber == 1) {
+			int cell = histoStatic->Fill(iPublisher % 8 + 0.5, 1 + iRound);
+			if (publisher != nullptr)
+				publisher->recordFill(histoStatic, cell, 1 + iRound);
+		}
+	}
+};
+
+// Publish the test histograms of one publisher for the runs firstRun to
+// lastRun, returns the exit code
+static int runPublisher(int iPublisher, const string& socketPath,
+		int firstRun, int lastRun) {
+	TestHistos testHistos;
+	PSvsTACHistoPublisher publisher(socketPath);
+	for (int runNumber = firstRun; runNumber <= lastRun; runNumber++) {
+		for (int iRound = 0; iRound < nRounds; iRound++) {
+			testHistos.fill(iPublisher, runNumber, iRound, &publisher);
+			for (auto histPointer : testHistos.getHistos())
+				publisher.publishHisto(runNumber, histPointer);
+			usleep(20000);
+		}
+		publisher.endRun(runNumber);
+	}
+	// The destructor sends what is still queued
+	return 0;
+}
+
+// Send deltas that the aggregator has to drop, returns the exit code
+static int runBadPublisher(const string& socketPath) {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+	int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socketFD < 0
+			|| connect(socketFD, reinterpret_cast<sockaddr*>(&address),
+					sizeof(address)) != 0) {
+		cerr << "Bad publisher cannot connect to " << socketPath << endl;
+		return 1;
+	}
+
+	PSvsTACDelta::Hello hello;
+	hello.hostName = "bad_publisher";
+	hello.processID = getpid();
+	PSvsTACDelta::Writer helloWriter;
+	hello.encode(helloWriter);
+
+	// A valid cell next to one whose index does not fit an int
+	PSvsTACDelta::HistoDelta outOfRange;
+	outOfRange.runNumber = 1;
+	outOfRange.name = "TEST_1D";
+	outOfRange.dimension = 1;
+	outOfRange.nBinsX = 10;
+	outOfRange.xMax = 10;
+	outOfRange.entries = 1000;
+	outOfRange.cells = { 3, 0xFFFFFFFF };
+	outOfRange.contents = { 1000, 1000 };
+	outOfRange.sumw2 = { 1000, 1000 };
+	PSvsTACDelta::Writer outOfRangeWriter;
+	outOfRange.encode(outOfRangeWriter);
+
+	// A valid cell of a histogram with a different binning
+	PSvsTACDelta::HistoDelta wrongBinning = outOfRange;
+	wrongBinning.name = "TEST_2D";
+	wrongBinning.dimension = 2;
+	wrongBinning.nBinsX = 11;
+	wrongBinning.nBinsY = 4;
+	wrongBinning.yMax = 4;
+	wrongBinning.cells = { 3 };
+	wrongBinning.contents = { 1000 };
+	wrongBinning.sumw2 = { 1000 };
+	PSvsTACDelta::Writer wrongBinningWriter;
+	wrongBinning.encode(wrongBinningWriter);
+
+	PSvsTACDelta::EndRun endRun;
+	endRun.runNumber = 1;
+	PSvsTACDelta::Writer endRunWriter;
+	endRun.encode(endRunWriter);
+
+	bool sent = PSvsTACDelta::sendMessage(socketFD, PSvsTACDelta::kHello,
+			helloWriter)
+			&& PSvsTACDelta::sendMessage(socketFD, PSvsTACDelta::kHistoDelta,
+					outOfRangeWriter)
+			&& PSvsTACDelta::sendMessage(socketFD, PSvsTACDelta::kHistoDelta,
+					wrongBinningWriter)
+			&& PSvsTACDelta::sendMessage(socketFD, PSvsTACDelta::kEndRun,
+					endRunWriter);
+	close(socketFD);
+	return sent ? 0 : 1;
+}
+
+// Start a child process running the function, returns its process ID
+template<typename Function>
+static pid_t startProcess(Function function) {
+	pid_t processID = fork();
+	if (processID == 0) {
+		int exitCode = function();
+		fflush(stdout);
+		fflush(stderr);
+		_exit(exitCode);
+	}
+	return processID;
+}
+
+static bool waitProcess(pid_t processID, const string& name) {
+	int status = 0;
+	if (processID < 0 || waitpid(processID, &status, 0) != processID
+			|| !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		cerr << name << " failed" << endl;
+		return false;
+	}
+	return true;
+}
+
+// Start the aggregator on the socket with the output into the directory
+static pid_t startAggregator(const string& aggregatorProgram,
+		const string& socketPath, const string& outputDir,
+		const string& graceTime) {
+	pid_t aggregatorID = fork();
+	if (aggregatorID == 0) {
+		execl(aggregatorProgram.c_str(), aggregatorProgram.c_str(), "-s",
+				socketPath.c_str(), "-o", outputDir.c_str(), "-g",
+				graceTime.c_str(), (char*) nullptr);
+		perror(aggregatorProgram.c_str());
+		_exit(1);
+	}
+	for (int iWait = 0; iWait < 50 && access(socketPath.c_str(), F_OK) != 0;
+			iWait++)
+		usleep(100000);
+	return aggregatorID;
+}
+
+// Sum of the histograms of the publishers that published the runs firstRun
+// to runNumber, without resetting the histograms between the runs
+static void fillExpected(TestHistos& expectedHistos,
+		const vector<int>& publishers, int firstRun, int runNumber) {
+	for (auto iPublisher : publishers) {
+		TestHistos publisherHistos;
+		for (int fillRun = firstRun; fillRun <= runNumber; fillRun++) {
+			for (int iRound = 0; iRound < nRounds; iRound++)
+				publisherHistos.fill(iPublisher, fillRun, iRound);
+		}
+		expectedHistos.histo1D->Add(publisherHistos.histo1D);
+		expectedHistos.histo2D->Add(publisherHistos.histo2D);
+		expectedHistos.histoStatic->Add(publisherHistos.histoStatic);
+	}
+}
+
+// Compare the merged file of the run with the expected histograms. Returns
+// an empty string if they match, the first difference otherwise.
+static string compareRun(const string& fileName,
+		const vector<TH1*>& expectedHistos) {
+	if (access(fileName.c_str(), R_OK) != 0)
+		return "no file " + fileName;
+	TFile inFile(fileName.c_str(), "READ");
+	if (inFile.IsZombie())
+		return "cannot open " + fileName;
+	stringstream differenceStream;
+	for (auto expectedHisto : expectedHistos) {
+		TH1* mergedHisto = dynamic_cast<TH1*>(inFile.Get(
+				expectedHisto->GetName()));
+		if (mergedHisto == nullptr) {
+			differenceStream << "no " << expectedHisto->GetName() << " in "
+					<< fileName;
+			break;
+		}
+		if (mergedHisto->GetNcells() != expectedHisto->GetNcells()) {
+			differenceStream << "binning of " << expectedHisto->GetName()
+					<< " in " << fileName;
+			break;
+		}
+		for (int iCell = 0; iCell < expectedHisto->GetNcells(); iCell++) {
+			double expectedError = expectedHisto->GetBinError(iCell);
+			double mergedError = mergedHisto->GetBinError(iCell);
+			if (fabs(mergedHisto->GetBinContent(iCell)
+					- expectedHisto->GetBinContent(iCell)) > 1e-9
+					|| fabs(mergedError * mergedError
+							- expectedError * expectedError) > 1e-9) {
+				differenceStream << expectedHisto->GetName() << " cell "
+						<< iCell << " in " << fileName << " is "
+						<< mergedHisto->GetBinContent(iCell) << " instead of "
+						<< expectedHisto->GetBinContent(iCell);
+				break;
+			}
+		}
+		if (differenceStream.str().size() == 0
+				&& mergedHisto->GetEntries() != expectedHisto->GetEntries())
+			differenceStream << "entries of " << expectedHisto->GetName()
+					<< " in " << fileName << " are "
+					<< mergedHisto->GetEntries() << " instead of "
+					<< expectedHisto->GetEntries();
+		if (differenceStream.str().size() > 0)
+			break;
+	}
+	inFile.Close();
+	return differenceStream.str();
+}
+
+// Wait for the merged file of the run to match the expected histograms. The
+// file is written again whenever the last open publisher of the run finishes
+// it. A matching file is checked once more a second later, a bad delta that
+// was added late would show up then. Returns the difference, if any.
+static string waitForRun(const string& fileName,
+		const TestHistos& expectedHistos) {
+	string difference;
+	for (int iWait = 0; iWait < 10 * maxWaitTime; iWait++) {
+		difference = compareRun(fileName, expectedHistos.getHistos());
+		if (difference.size() == 0) {
+			sleep(1);
+			return compareRun(fileName, expectedHistos.getHistos());
+		}
+		usleep(100000);
+	}
+	return difference;
+}
+
+static string readFile(const string& fileName) {
+	ifstream inStream(fileName.c_str());
+	stringstream contentStream;
+	contentStream << inStream.rdbuf();
+	return contentStream.str();
+}
+
+// Publish a run through an aggregator with a short grace time, let the
+// aggregator drop the run and publish more data for it from another process.
+// A file of the run that exists before the aggregator starts has to stay
+// untouched. Returns the exit code.
+static int runLatePublisherTest(const string& aggregatorProgram,
+		const string& testDir) {
+	string lateDir = testDir + "/late";
+	string socketPath = lateDir + "/aggregator.sock";
+	stringstream fileNameStream;
+	fileNameStream << lateDir << "/ps_vs_tac_calib_" << lateRunNumber;
+	string oldFileName = fileNameStream.str() + ".root";
+	string mergedFileName = fileNameStream.str() + "_1.root";
+	const string oldContent = "file of an earlier processing\n";
+	mkdir(lateDir.c_str(), 0700);
+	ofstream(oldFileName.c_str()) << oldContent;
+
+	pid_t aggregatorID = startAggregator(aggregatorProgram, socketPath,
+			lateDir, "1");
+	bool passed = true;
+	vector<int> publishers;
+	for (int iPublisher = 0; iPublisher < 2 && passed; iPublisher++) {
+		// Past the grace time the aggregator drops the written run
+		if (iPublisher > 0)
+			sleep(4);
+		passed = waitProcess(startProcess([iPublisher, &socketPath]() {
+			return runPublisher(iPublisher, socketPath, lateRunNumber,
+					lateRunNumber);
+		}), "Late publisher");
+		publishers.push_back(iPublisher);
+		TestHistos expectedHistos;
+		fillExpected(expectedHistos, publishers, lateRunNumber, lateRunNumber);
+		string difference = waitForRun(mergedFileName, expectedHistos);
+		if (difference.size() > 0) {
+			cerr << "Late run after " << publishers.size() << " publishers: "
+					<< difference << endl;
+			passed = false;
+		}
+	}
+	if (readFile(oldFileName) != oldContent) {
+		cerr << "File " << oldFileName << " was overwritten" << endl;
+		passed = false;
+	}
+	if (passed)
+		cout << "Late run: merged histograms match" << endl;
+
+	kill(aggregatorID, SIGTERM);
+	passed = waitProcess(aggregatorID, "Late aggregator") && passed;
+	return passed ? 0 : 1;
+}
+
+static void removeDirectory(const string& dirName) {
+	DIR* dir = opendir(dirName.c_str());
+	if (dir != nullptr) {
+		while (dirent* entry = readdir(dir)) {
+			string entryName = entry->d_name;
+			if (entryName == "." || entryName == "..")
+				continue;
+			struct stat entryStat;
+			string entryPath = dirName + "/" + entryName;
+			if (lstat(entryPath.c_str(), &entryStat) == 0
+					&& S_ISDIR(entryStat.st_mode))
+				removeDirectory(entryPath);
+			else
+				unlink(entryPath.c_str());
+		}
+		closedir(dir);
+	}
+	rmdir(dirName.c_str());
+}
+
+int main(int argc, char* argv[]) {
+	int nPublishers = 4;
+	string aggregatorProgram = "./ps_vs_tac_aggregator";
+	int option;
+	while ((option = getopt(argc, argv, "n:a:h")) != -1) {
+		switch (option) {
+		case 'n':
+			nPublishers = atoi(optarg);
+			break;
+		case 'a':
+			aggregatorProgram = optarg;
+			break;
+		default:
+			cerr << "Usage: " << argv[0]
+					<< " [-n publishers] [-a aggregator_program]" << endl;
+			return 1;
+		}
+	}
+
+	TH1::AddDirectory(false);
+	char dirTemplate[] = "/tmp/ps_vs_tac_test_XXXXXX";
+	if (mkdtemp(dirTemplate) == nullptr) {
+		perror("mkdtemp");
+		return 1;
+	}
+	string testDir = dirTemplate;
+	string socketPath = testDir + "/aggregator.sock";
+
+	// A long grace time, so that no run is forgotten while the test runs
+	pid_t aggregatorID = startAggregator(aggregatorProgram, socketPath,
+			testDir, "600");
+
+	bool passed = true;
+	vector<pid_t> publisherIDs;
+	for (int iPublisher = 0; iPublisher < nPublishers; iPublisher++)
+		publisherIDs.push_back(startProcess([iPublisher, &socketPath]() {
+			return runPublisher(iPublisher, socketPath, 1, nRuns);
+		}));
+	for (auto processID : publisherIDs)
+		passed = waitProcess(processID, "Publisher") && passed;
+	// The bad deltas come after the good ones, so that they cannot define the
+	// binning of the merged histograms
+	passed = waitProcess(startProcess([&socketPath]() {
+		return runBadPublisher(socketPath);
+	}), "Bad publisher") && passed;
+
+	vector<int> publishers;
+	for (int iPublisher = 0; iPublisher < nPublishers; iPublisher++)
+		publishers.push_back(iPublisher);
+	for (int runNumber = 1; runNumber <= nRuns && passed; runNumber++) {
+		TestHistos expectedHistos;
+		fillExpected(expectedHistos, publishers, 1, runNumber);
+		stringstream fileNameStream;
+		fileNameStream << testDir << "/ps_vs_tac_calib_" << runNumber
+				<< ".root";
+		string difference = waitForRun(fileNameStream.str(), expectedHistos);
+		if (difference.size() > 0) {
+			cerr << "Run " << runNumber << ": " << difference << endl;
+			passed = false;
+		} else
+			cout << "Run " << runNumber << ": merged histograms match" << endl;
+	}
+
+	kill(aggregatorID, SIGTERM);
+	passed = waitProcess(aggregatorID, "Aggregator") && passed;
+	if (passed)
+		passed = (runLatePublisherTest(aggregatorProgram, testDir) == 0);
+	if (passed)
+		removeDirectory(testDir);
+	else
+		cerr << "Output kept in " << testDir << endl;
+	cout << (passed ? "PASSED" : "FAILED") << endl;
+	return passed ? 0 : 1;
+}